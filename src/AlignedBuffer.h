@@ -0,0 +1,80 @@
+#pragma once
+#include <malloc.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+#include "MemoryTracker.h"
+
+// Fixed size array of trivially copyable elements, allocated once with the
+// alignment and tail padding Embree needs from buffers shared through
+// rtcSetBuffer2: 16 byte aligned, and the last element readable with a
+// full 16 byte SSE load.
+template <typename T>
+class AlignedBuffer
+{
+public:
+	AlignedBuffer() = default;
+	explicit AlignedBuffer(size_t count) { allocate(count); }
+	~AlignedBuffer() { release(); }
+
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+	AlignedBuffer(AlignedBuffer&& other) : Data(other.Data), Count(other.Count)
+	{
+		other.Data = nullptr;
+		other.Count = 0;
+	}
+
+	AlignedBuffer& operator=(AlignedBuffer&& other)
+	{
+		std::swap(Data, other.Data);
+		std::swap(Count, other.Count);
+		return *this;
+	}
+
+	// Drops the old contents, the new elements are uninitialized. Throws
+	// std::bad_alloc like new when there is no memory, the buffer is then empty.
+	void allocate(size_t count)
+	{
+		release();
+		if (count > 0)
+		{
+			Data = static_cast<T*>(_aligned_malloc(count * sizeof(T) + Padding, Alignment));
+			if (!Data)
+			{
+				throw std::bad_alloc();
+			}
+			Count = count;
+			TrackMemory(MemoryCategory::Geometry, (int64_t)bytes());
+		}
+	}
+
+	void release()
+	{
+		if (Data)
+		{
+			TrackMemory(MemoryCategory::Geometry, -(int64_t)bytes());
+			_aligned_free(Data);
+		}
+		Data = nullptr;
+		Count = 0;
+	}
+
+	T* data() { return Data; }
+	const T* data() const { return Data; }
+	size_t size() const { return Count; }
+	size_t bytes() const { return Count * sizeof(T); }
+	bool empty() const { return Count == 0; }
+
+	T& operator[](size_t i) { return Data[i]; }
+	const T& operator[](size_t i) const { return Data[i]; }
+
+private:
+	static const size_t Alignment = 16;
+	static const size_t Padding = 16;
+
+	T* Data = nullptr;
+	size_t Count = 0;
+};
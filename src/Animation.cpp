@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "tbb/tbb.h"
+
+#include "Animation.h"
+
+/* widest %0Nd accepted in a frame pattern */
+static const uint32_t MAX_FRAME_DIGITS{ 16 };
+
+// Finds the one %d, %Nd or %0Nd of a pattern. Every other '%' has to be part
+// of a "%%", anything else is not a frame pattern.
+static bool findFrameConversion(const std::string& pattern, size_t& begin, size_t& end, uint32_t& width, bool& zeroPad)
+{
+	bool found = false;
+	for (size_t i = 0; i < pattern.size(); ++i)
+	{
+		if (pattern[i] != '%')
+		{
+			continue;
+		}
+		if (i + 1 < pattern.size() && pattern[i + 1] == '%')
+		{
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		const bool zero = j < pattern.size() && pattern[j] == '0';
+		if (zero)
+		{
+			++j;
+		}
+
+		uint32_t digits = 0;
+		while (j < pattern.size() && pattern[j] >= '0' && pattern[j] <= '9')
+		{
+			digits = digits * 10 + (pattern[j] - '0');
+			if (digits > MAX_FRAME_DIGITS)
+			{
+				return false;
+			}
+			++j;
+		}
+
+		if (found || j >= pattern.size() || pattern[j] != 'd')
+		{
+			return false;
+		}
+
+		found = true;
+		begin = i;
+		end = j + 1;
+		width = digits;
+		zeroPad = zero;
+		i = j;
+	}
+
+	return found;
+}
+
+// Turns the "%%" of a pattern into '%'.
+static std::string unescapePercent(const std::string& text)
+{
+	std::string result;
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		result += text[i];
+		if (text[i] == '%' && i + 1 < text.size() && text[i + 1] == '%')
+		{
+			++i;
+		}
+	}
+	return result;
+}
+
+bool IsFrameSequence(const std::string& Filename)
+{
+	size_t begin = 0, end = 0;
+	uint32_t width = 0;
+	bool zeroPad = false;
+	return findFrameConversion(Filename, begin, end, width, zeroPad);
+}
+
+std::string FrameFilename(const std::string& pattern, uint32_t frame)
+{
+	size_t begin = 0, end = 0;
+	uint32_t width = 0;
+	bool zeroPad = false;
+	if (!findFrameConversion(pattern, begin, end, width, zeroPad))
+	{
+		return pattern;
+	}
+
+	std::string number = std::to_string(frame);
+	if (number.size() < width)
+	{
+		number.insert(0, width - number.size(), zeroPad ? '0' : ' ');
+	}
+
+	return unescapePercent(pattern.substr(0, begin)) + number + unescapePercent(pattern.substr(end));
+}
+
+std::string FrameOutputFilename(const std::string& Filename, uint32_t frame)
+{
+	if (IsFrameSequence(Filename))
+	{
+		return FrameFilename(Filename, frame);
+	}
+
+	const size_t dot = Filename.find_last_of('.');
+	const size_t slash = Filename.find_last_of("/\\");
+	const size_t split = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : Filename.size();
+	return Filename.substr(0, split) + FrameFilename(".%04d", frame) + Filename.substr(split);
+}
+
+bool UpdateAnimatedMeshes(std::vector<AnimatedMesh>& meshes, uint32_t frame)
+{
+	// frames are parsed in parallel, but scene edits are not thread safe.
+	std::vector<MeshData> frames(meshes.size());
+	std::atomic<bool> loaded{ true };
+	tbb::parallel_for(size_t(0), meshes.size(), [&meshes, &frames, frame, &loaded](size_t i)
+	{
+		if (!LoadObjMeshData(FrameFilename(meshes[i].pattern, frame), frames[i]))
+		{
+			loaded = false;
+		}
+	});
+
+	if (!loaded)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		if (!meshes[i].mesh->updateVertices(frames[i]))
+		{
+			std::cerr << FrameFilename(meshes[i].pattern, frame) << " doesn't have the topology of the first frame." << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool LoadTransformTrack(const std::string& Filename, std::vector<TransformKey>& keys, std::string& err)
+{
+	std::ifstream file(Filename);
+	if (!file)
+	{
+		err = "Cannot open transform track " + Filename;
+		return false;
+	}
+
+	std::string line;
+	for (uint32_t lineNumber = 1; std::getline(file, line); ++lineNumber)
+	{
+		std::istringstream fields(line.substr(0, line.find('#')));
+		TransformKey key;
+		if (!(fields >> key.frame))
+		{
+			continue;
+		}
+
+		std::vector<float> values;
+		float value = 0.0f;
+		const bool hasInstance = static_cast<bool>(fields >> key.instance);
+		while (fields >> value)
+		{
+			values.push_back(value);
+		}
+
+		if (!hasInstance || !MakeTransform(values, key.transform))
+		{
+			err = Filename + ":" + std::to_string(lineNumber) + ": expected '<frame> <instance>' and a translation or a 3x4 transform";
+			return false;
+		}
+		keys.push_back(key);
+	}
+
+	// keys of one frame keep their file order.
+	std::stable_sort(keys.begin(), keys.end(), [](const TransformKey& a, const TransformKey& b)
+	{
+		return a.frame < b.frame;
+	});
+	return true;
+}
+
+bool ApplyTransformKeys(const std::vector<TransformKey>& keys, size_t& nextKey, uint32_t frame, SceneGraph& graph)
+{
+	for (; nextKey < keys.size() && keys[nextKey].frame <= frame; ++nextKey)
+	{
+		const TransformKey& key = keys[nextKey];
+		if (key.instance >= graph.getNumInstances())
+		{
+			std::cerr << "Transform track moves instance " << key.instance << ", but the scene has " << graph.getNumInstances() << "." << std::endl;
+			return false;
+		}
+		graph.setTransform(key.instance, key.transform);
+	}
+
+	return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Mesh.h"
+#include "SceneGraph.h"
+
+// Animated meshes are given as patterns of per frame OBJ files, e.g.
+// "walk.%04d.obj". A pattern has exactly one %d, %Nd or %0Nd and writes a
+// literal '%' as "%%". Every frame must have the topology of the first one.
+struct AnimatedMesh
+{
+	std::string pattern;
+	Mesh* mesh;
+};
+
+// Whether the name is a valid frame pattern. Names with any other '%' are
+// rejected on the command line.
+bool IsFrameSequence(const std::string& Filename);
+std::string FrameFilename(const std::string& pattern, uint32_t frame);
+// Output image of the frame, the pattern or the frame number before the extension.
+std::string FrameOutputFilename(const std::string& Filename, uint32_t frame);
+
+// Loads the frame of every animated mesh in parallel and updates its vertices
+// in place. The scene has to be committed afterwards, Embree refits the BVHs
+// of the deformable geometry instead of rebuilding them.
+bool UpdateAnimatedMeshes(std::vector<AnimatedMesh>& meshes, uint32_t frame);
+
+// Rigid animation of the instances of a scene graph. A transform track is a
+// text file with one key per line, '#' starts a comment:
+//   <frame> <instance> <12 floats or a translation>
+// Instances are numbered from 0 in the order they are placed. A key holds
+// until the next key of the same instance.
+struct TransformKey
+{
+	uint32_t frame;
+	uint32_t instance;
+	float transform[12];
+};
+
+// Keys are returned sorted by frame.
+bool LoadTransformTrack(const std::string& Filename, std::vector<TransformKey>& keys, std::string& err);
+
+// Applies the keys from nextKey up to the frame and advances nextKey past
+// them. Only the transforms change, the scene has to be committed afterwards.
+bool ApplyTransformKeys(const std::vector<TransformKey>& keys, size_t& nextKey, uint32_t frame, SceneGraph& graph);
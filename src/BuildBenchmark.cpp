@@ -0,0 +1,85 @@
+#include <chrono>
+#include <iostream>
+
+#include "BuildBenchmark.h"
+#include "MemoryTracker.h"
+#include "RenderSession.h"
+
+/* iterations rendered per candidate before and while timing */
+static const uint32_t BENCHMARK_WARMUP_ITERATIONS{ 1 };
+static const uint32_t BENCHMARK_ITERATIONS{ 2 };
+/* sample count assumed when the render has none, e.g. an interactive preview */
+static const uint32_t BENCHMARK_DEFAULT_SPP{ 64 };
+
+static const int BENCHMARK_CANDIDATES[] =
+{
+	RTC_SCENE_STATIC,
+	RTC_SCENE_STATIC | RTC_SCENE_COMPACT,
+	RTC_SCENE_STATIC | RTC_SCENE_HIGH_QUALITY,
+	RTC_SCENE_STATIC | RTC_SCENE_ROBUST,
+	RTC_SCENE_STATIC | RTC_SCENE_COHERENT,
+	RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT,
+	// refit friendly, built with a faster but lower quality builder.
+	RTC_SCENE_DYNAMIC,
+};
+
+int BenchmarkSceneFlags(const RenderOptions& options, const SceneBuilder& build, const std::vector<Material>& Materials)
+{
+	const uint32_t spp = options.spp > 0 ? options.spp : BENCHMARK_DEFAULT_SPP;
+
+	int best = options.sceneFlags;
+	double bestSeconds = -1.0;
+
+	for (int sceneFlags : BENCHMARK_CANDIDATES)
+	{
+		BuildTimes times;
+		RTCScene scene = build(sceneFlags, times);
+		if (!scene)
+		{
+			std::cout << SceneFlagsName(sceneFlags) << ": build failed\n";
+			continue;
+		}
+		const int64_t embreeBytes = GetTrackedMemory(MemoryCategory::Embree);
+
+		RenderOptions candidate = options;
+		candidate.sceneFlags = sceneFlags;
+		candidate.adaptive.enabled = false;
+
+		// every build is a new scene, so cached camera hits never carry over.
+		RenderSession session(candidate);
+		if (!session.isAllocated())
+		{
+			std::cout << SceneFlagsName(sceneFlags) << ": the image doesn't fit the memory budget\n";
+			continue;
+		}
+		for (uint32_t i = 0; i < BENCHMARK_WARMUP_ITERATIONS; ++i)
+		{
+			session.renderIteration(scene, 1, Materials);
+		}
+
+		uint64_t numRays = 0;
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; ++i)
+		{
+			numRays += session.renderIteration(scene, 1, Materials);
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		// loading the meshes is the same for every candidate, only the BVH build counts.
+		const double secondsPerSample = seconds / BENCHMARK_ITERATIONS;
+		const double totalSeconds = times.buildMs / 1000.0 + secondsPerSample * spp;
+		const double raysPerSecond = seconds > 0.0 ? (double)numRays / seconds : 0.0;
+
+		std::cout << SceneFlagsName(sceneFlags) << ": load " << times.loadMs << " ms, build " << times.buildMs << " ms, Embree " << (double)embreeBytes / (1024.0 * 1024.0) << " MB, "
+			<< raysPerSecond / 1000000.0 << " Mrays/s, " << totalSeconds << " s for " << spp << " spp\n";
+
+		if (bestSeconds < 0.0 || totalSeconds < bestSeconds)
+		{
+			bestSeconds = totalSeconds;
+			best = sceneFlags;
+		}
+	}
+
+	std::cout << "Best scene flags for " << spp << " spp: " << SceneFlagsName(best) << " (--scene-flags " << SceneFlagsName(best) << ")\n";
+	return best;
+}
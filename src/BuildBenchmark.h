@@ -0,0 +1,25 @@
+#pragma once
+#include <functional>
+#include <vector>
+
+#include <embree2/rtcore.h>
+
+#include "Material.h"
+#include "Options.h"
+
+// Milliseconds spent loading the meshes and committing their BVHs.
+struct BuildTimes
+{
+	double loadMs = 0.0;
+	double buildMs = 0.0;
+};
+
+// Builds the loaded scene with the given scene flags and returns it, or null
+// if the build failed. The previous build is released first.
+typedef std::function<RTCScene(int sceneFlags, BuildTimes& times)> SceneBuilder;
+
+// Builds and traces the scene with each candidate set of scene flags and
+// returns the one that finishes the requested sample count soonest, counting
+// its BVH build time. A short preview favors fast builds, a long render favors
+// fast traversal.
+int BenchmarkSceneFlags(const RenderOptions& options, const SceneBuilder& build, const std::vector<Material>& Materials);
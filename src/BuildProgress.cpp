@@ -0,0 +1,40 @@
+#include "BuildProgress.h"
+#include "MemoryTracker.h"
+
+// called by Embree from its build threads, returning false cancels the build.
+static bool progressMonitor(void* ptr, const double n)
+{
+	BuildProgress* progress = static_cast<BuildProgress*>(ptr);
+	progress->fraction = (float)n;
+	return !progress->cancelled;
+}
+
+bool CommitScene(RTCScene scene, BuildProgress* progress)
+{
+	// only a refusal during this build fails it, not the application's own buffers.
+	ClearEmbreeMemoryRefused();
+	if (!progress)
+	{
+		rtcCommit(scene);
+		return !WasEmbreeMemoryRefused();
+	}
+
+	if (progress->cancelled)
+	{
+		return false;
+	}
+
+	// a cancelled commit reports RTC_CANCELLED to the error handler and leaves the scene unbuilt.
+	rtcSetProgressMonitorFunction(scene, progressMonitor, progress);
+	rtcCommit(scene);
+	rtcSetProgressMonitorFunction(scene, nullptr, nullptr);
+
+	// a refused allocation fails the commit the same way.
+	if (progress->cancelled || WasEmbreeMemoryRefused())
+	{
+		return false;
+	}
+
+	progress->numCommitted++;
+	return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+#include <embree2/rtcore.h>
+
+// Progress of the BVH builds of a scene and its asset scenes, written by the
+// build thread and read by the window. Setting cancelled stops the builds.
+struct BuildProgress
+{
+	std::atomic<uint32_t> numScenes{ 0 };
+	std::atomic<uint32_t> numCommitted{ 0 };
+	// completed fraction of the build that reported last.
+	std::atomic<float> fraction{ 0.0f };
+	std::atomic<bool> cancelled{ false };
+};
+
+// Commits the scene while reporting to progress, which may be null.
+// Returns false if the build was cancelled or Embree was refused memory by the budget.
+bool CommitScene(RTCScene scene, BuildProgress* progress);
@@ -0,0 +1,22 @@
+#pragma once
+#include <embree2/rtcore.h>
+
+#include "VectorTypes.h"
+
+// Placement of an asset scene in the top level scene. Attached to the
+// instance geometry as user data, so hits on it can be shaded.
+struct Instance
+{
+	// scene of the instanced asset, hits are looked up in it.
+	RTCScene scene;
+	// row-major inverse transpose of the upper 3x3 of the transform.
+	float normalTransform[9];
+
+	vec3 transformNormal(const vec3& N) const
+	{
+		return vec3(
+			normalTransform[0] * N.x + normalTransform[1] * N.y + normalTransform[2] * N.z,
+			normalTransform[3] * N.x + normalTransform[4] * N.y + normalTransform[5] * N.z,
+			normalTransform[6] * N.x + normalTransform[7] * N.y + normalTransform[8] * N.z);
+	}
+};
@@ -0,0 +1,140 @@
+#include "MappedFile.h"
+#include "MemoryTracker.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& Filename)
+{
+	close();
+
+	HANDLE file = CreateFileA(Filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	File = file;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		close();
+		return false;
+	}
+
+	// an empty file can't be mapped, but it is still a valid empty view.
+	Size = (size_t)fileSize.QuadPart;
+	if (Size == 0)
+	{
+		return true;
+	}
+
+	Mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!Mapping)
+	{
+		close();
+		return false;
+	}
+
+	Data = static_cast<const char*>(MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!Data)
+	{
+		close();
+		return false;
+	}
+
+	TrackMemory(MemoryCategory::MappedFiles, (int64_t)Size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (Data)
+	{
+		TrackMemory(MemoryCategory::MappedFiles, -(int64_t)Size);
+		UnmapViewOfFile(Data);
+	}
+	if (Mapping)
+	{
+		CloseHandle(Mapping);
+	}
+	if (File)
+	{
+		CloseHandle(File);
+	}
+
+	Data = nullptr;
+	Size = 0;
+	Mapping = nullptr;
+	File = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const std::string& Filename)
+{
+	close();
+
+	File = ::open(Filename.c_str(), O_RDONLY);
+	if (File < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(File, &info) != 0)
+	{
+		close();
+		return false;
+	}
+
+	// an empty file can't be mapped, but it is still a valid empty view.
+	Size = (size_t)info.st_size;
+	if (Size == 0)
+	{
+		return true;
+	}
+
+	void* mapped = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, File, 0);
+	if (mapped == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+
+	Data = static_cast<const char*>(mapped);
+	TrackMemory(MemoryCategory::MappedFiles, (int64_t)Size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (Data)
+	{
+		TrackMemory(MemoryCategory::MappedFiles, -(int64_t)Size);
+		munmap(const_cast<char*>(Data), Size);
+	}
+	if (File >= 0)
+	{
+		::close(File);
+	}
+
+	Data = nullptr;
+	Size = 0;
+	File = -1;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+#include <string>
+
+// Read only view of a whole file mapped into memory.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& Filename);
+	void close();
+
+	const char* data() const { return Data; }
+	size_t size() const { return Size; }
+
+private:
+	const char* Data = nullptr;
+	size_t Size = 0;
+#ifdef _WIN32
+	void* File = nullptr;
+	void* Mapping = nullptr;
+#else
+	int File = -1;
+#endif
+};
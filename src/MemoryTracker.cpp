@@ -0,0 +1,131 @@
+#include <atomic>
+#include <iostream>
+
+#include "MemoryTracker.h"
+
+static const size_t NUM_CATEGORIES = (size_t)MemoryCategory::Count;
+static const char* CATEGORY_NAMES[NUM_CATEGORIES] = { "Embree", "geometry", "mapped files", "images" };
+
+static std::atomic<int64_t> currentBytes[NUM_CATEGORIES];
+static std::atomic<int64_t> peakBytes[NUM_CATEGORIES];
+// usage counted against the budget, everything but mapped files.
+static std::atomic<int64_t> budgetedBytes{ 0 };
+static std::atomic<int64_t> peakBudgetedBytes{ 0 };
+
+static std::atomic<uint64_t> budget{ 0 };
+static std::atomic<bool> overBudget{ false };
+static std::atomic<bool> embreeRefused{ false };
+
+static void updatePeak(std::atomic<int64_t>& peak, int64_t value)
+{
+	int64_t previous = peak;
+	while (value > previous && !peak.compare_exchange_weak(previous, value))
+	{
+	}
+}
+
+void TrackMemory(MemoryCategory category, int64_t bytes)
+{
+	const size_t c = (size_t)category;
+	updatePeak(peakBytes[c], currentBytes[c] += bytes);
+
+	if (category != MemoryCategory::MappedFiles)
+	{
+		const int64_t budgeted = budgetedBytes += bytes;
+		updatePeak(peakBudgetedBytes, budgeted);
+		const uint64_t limit = budget;
+		if (limit > 0 && budgeted > (int64_t)limit)
+		{
+			overBudget = true;
+		}
+	}
+}
+
+bool ReserveMemory(MemoryCategory category, int64_t bytes)
+{
+	const uint64_t limit = budget;
+	if (category != MemoryCategory::MappedFiles && limit > 0 && budgetedBytes + bytes > (int64_t)limit)
+	{
+		return false;
+	}
+	TrackMemory(category, bytes);
+	return true;
+}
+
+int64_t GetTrackedMemory(MemoryCategory category)
+{
+	return currentBytes[(size_t)category];
+}
+
+void SetMemoryBudget(uint64_t bytes)
+{
+	budget = bytes;
+}
+
+uint64_t GetMemoryBudget()
+{
+	return budget;
+}
+
+bool IsOverMemoryBudget()
+{
+	return overBudget;
+}
+
+void ResetMemoryBudget()
+{
+	overBudget = false;
+}
+
+bool WasEmbreeMemoryRefused()
+{
+	return embreeRefused;
+}
+
+void ClearEmbreeMemoryRefused()
+{
+	embreeRefused = false;
+}
+
+// Embree announces allocations before they happen and may be refused. A
+// refused announcement is not counted, the allocation never happens.
+static bool embreeMemoryMonitor(void*, const ssize_t bytes, const bool post)
+{
+	const uint64_t limit = budget;
+	const bool refuse = bytes > 0 && limit > 0 && budgetedBytes + bytes > (int64_t)limit;
+	if (refuse)
+	{
+		embreeRefused = true;
+	}
+	if (!refuse || post)
+	{
+		TrackMemory(MemoryCategory::Embree, bytes);
+	}
+	return !refuse;
+}
+
+void TrackEmbreeMemory(RTCDevice device)
+{
+	rtcDeviceSetMemoryMonitorFunction2(device, embreeMemoryMonitor, nullptr);
+}
+
+static double megabytes(int64_t bytes)
+{
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+void ReportMemory(const char* stage)
+{
+	std::cout << "Memory after " << stage << ": " << megabytes(budgetedBytes) << " MB, peak " << megabytes(peakBudgetedBytes) << " MB";
+	const uint64_t limit = budget;
+	if (limit > 0)
+	{
+		std::cout << ", budget " << megabytes((int64_t)limit) << " MB";
+	}
+	std::cout << "\n";
+
+	for (size_t c = 0; c < NUM_CATEGORIES; ++c)
+	{
+		std::cout << "  " << CATEGORY_NAMES[c] << ": " << megabytes(currentBytes[c]) << " MB, peak " << megabytes(peakBytes[c]) << " MB\n";
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+#include <embree2/rtcore.h>
+
+// Process wide accounting of the big allocations: Embree's own memory, as
+// reported by its memory monitor, and the application's buffers.
+enum class MemoryCategory
+{
+	Embree,
+	Geometry,
+	// file pages mapped read only, the OS can drop them under pressure.
+	MappedFiles,
+	Images,
+	Count
+};
+
+// Records an allocation, or a release if bytes is negative.
+void TrackMemory(MemoryCategory category, int64_t bytes);
+// Records an allocation that is about to be made if it fits the budget.
+// Returns false and records nothing if it doesn't, the caller then skips it.
+bool ReserveMemory(MemoryCategory category, int64_t bytes);
+int64_t GetTrackedMemory(MemoryCategory category);
+
+// Sets the budget in bytes for all categories but mapped files, 0 for none.
+// Embree allocations that would exceed it are refused, which fails the
+// scene commit with RTC_OUT_OF_MEMORY instead of exhausting the machine.
+void SetMemoryBudget(uint64_t bytes);
+uint64_t GetMemoryBudget();
+// Whether usage went over the budget since the last reset.
+bool IsOverMemoryBudget();
+void ResetMemoryBudget();
+// Whether Embree was refused an allocation since the last clear. Only this
+// fails a scene commit, CommitScene clears it before building.
+bool WasEmbreeMemoryRefused();
+void ClearEmbreeMemoryRefused();
+
+// Installs the Embree memory monitor on the device.
+void TrackEmbreeMemory(RTCDevice device);
+
+// Prints current and peak usage per category.
+void ReportMemory(const char* stage);
@@ -1,168 +1,399 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <unordered_map>
 
+#include "MappedFile.h"
 #include "Mesh.h"
+#include "ObjParser.h"
+#include "SceneCache.h"
+#include "VectorTypes.h"
+#include "tbb/tbb.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include "tiny_obj_loader.h"
 
-struct Vertex { float x, y, z, w; };
-struct Normal { float x, y, z; };
-struct TextureCoord { float u, v; };
-struct Triangle { int v0, v1, v2; };
-const size_t alignment = 16;
-
-void LoadObjMesh(const std::string & Filename, RTCScene scene, std::vector<TriangleMesh*>& OutMeshes, std::vector<Material>& OutMaterials)
+// An OBJ face corner, corners with the same triple share one welded vertex.
+struct VertexKey
 {
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-
-	std::string err;
-	const bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, Filename.c_str());
+	int vertex, normal, texcoord;
 
-	if (ret == false || shapes.size() < 1)
+	bool operator==(const VertexKey& rhs) const
 	{
-		std::cerr << err << std::endl;
-		return;
+		return vertex == rhs.vertex && normal == rhs.normal && texcoord == rhs.texcoord;
 	}
+};
 
-	for (const tinyobj::shape_t& shape : shapes)
+struct VertexKeyHash
+{
+	size_t operator()(const VertexKey& key) const
 	{
-		std::vector<float> positions, normals, texcoords;
-		std::vector<int> indices;
-		int materialID = -1;
+		size_t h = std::hash<int>()(key.vertex);
+		h ^= std::hash<int>()(key.normal) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		h ^= std::hash<int>()(key.texcoord) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		return h;
+	}
+};
 
-		int index = 0;
-		size_t indexOffset = 0;
+// Flat normal for corners of face f that have none.
+static Normal faceNormal(const ObjData& obj, size_t f)
+{
+	// the diagonals of a quad, for a triangle the last corner is repeated.
+	const ObjCorner* corners = &obj.corners[4 * f];
+	const float* p0 = &obj.positions[3 * corners[0].vertex];
+	const float* p1 = &obj.positions[3 * corners[1].vertex];
+	const float* p2 = &obj.positions[3 * corners[2].vertex];
+	const float* p3 = &obj.positions[3 * corners[3].vertex];
+	const vec3 e1(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+	const vec3 e2(p3[0] - p1[0], p3[1] - p1[1], p3[2] - p1[2]);
+	const vec3 n = cross(e1, e2);
+	const vec3 N = n.length() > 0.0f ? normalize(n) : vec3(0.0f, 1.0f, 0.0f);
+	return Normal{ N.x, N.y, N.z };
+}
 
-		// for each face
-		//for (const unsigned char& f : shape.mesh.num_face_vertices)
-		for (int i = 0; i < shape.mesh.num_face_vertices.size(); ++i)
-		{
-			const unsigned char& fv = shape.mesh.num_face_vertices[i];
+// Material table of an OBJ file, faces without a material use the grey
+// default appended at the end.
+static std::vector<Material> objMaterials(const ObjData& obj)
+{
+	std::vector<Material> materials;
+	for (const tinyobj::material_t& material : obj.materials)
+	{
+		materials.push_back({ { material.diffuse[0], material.diffuse[1], material.diffuse[2] } });
+	}
+	materials.push_back({ { 0.6f, 0.6f, 0.6f } });
+	return materials;
+}
 
-			// we only deal with triangulated meshes.
-			assert(fv == 3);
+// Assigns every distinct corner of the shape its index in the shape's vertex
+// pool, writes the shape's slice of the index and material ID buffers, and
+// returns the corners that make up the pool.
+static std::vector<VertexKey> weldShape(const ObjData& obj, const ObjShape& shape, MeshData& mesh)
+{
+	// maps each distinct corner to its index in the welded vertex pool.
+	std::unordered_map<VertexKey, int, VertexKeyHash> welded;
+	welded.reserve(shape.numFaces * 4);
+	std::vector<VertexKey> unique;
 
-			// for each vert of face
-			for (size_t v = 0; v < fv; ++v)
-			{
-				tinyobj::index_t idx = shape.mesh.indices[indexOffset + v];
-				tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-				tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-				tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-				tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-				tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-				tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-				tinyobj::real_t tx = idx.texcoord_index > -1 ? attrib.texcoords[2 * idx.texcoord_index + 0] : 0.0f;
-				tinyobj::real_t ty = idx.texcoord_index > -1 ? attrib.texcoords[2 * idx.texcoord_index + 1] : 0.0f;
-
-				positions.push_back(vx);
-				positions.push_back(vy);
-				positions.push_back(vz);
-
-				normals.push_back(nx);
-				normals.push_back(ny);
-				normals.push_back(nz);
-
-				texcoords.push_back(tx);
-				texcoords.push_back(ty);
-
-				indices.push_back(index++);
-			}
-			indexOffset += fv;
+	const uint32_t defaultMaterial = (uint32_t)obj.materials.size();
+	for (size_t f = shape.firstFace; f < shape.firstFace + shape.numFaces; ++f)
+	{
+		int face[4];
+
+		// for each vert of face, a triangle's repeated last corner welds to the same vertex.
+		for (size_t v = 0; v < 4; ++v)
+		{
+			const ObjCorner& idx = obj.corners[4 * f + v];
 
-			if (materialID == -1)
+			// flat shaded corners are never shared between faces.
+			const VertexKey key{ idx.vertex, idx.normal >= 0 ? idx.normal : -2 - (int)f, idx.texcoord };
+			const auto inserted = welded.insert(std::make_pair(key, (int)unique.size()));
+			if (inserted.second)
 			{
-				materialID = shape.mesh.material_ids[i];
+				unique.push_back(key);
 			}
+			face[v] = inserted.first->second;
 		}
 
-		tinyobj::material_t& material = materials[materialID];
-		OutMaterials.push_back({ { material.diffuse[0], material.diffuse[1], material.diffuse[2] } });
-
-		const size_t numTriangles = shape.mesh.num_face_vertices.size();
-		const size_t numVertices = positions.size() / 3;
-		TriangleMesh* mesh = new TriangleMesh(scene, positions, normals, texcoords, indices, numTriangles, numVertices);
-		OutMeshes.push_back(mesh);
+		if (mesh.quads.empty())
+		{
+			mesh.triangles[f] = Triangle{ face[0], face[1], face[2] };
+		}
+		else
+		{
+			mesh.quads[f] = Quad{ face[0], face[1], face[2], face[3] };
+		}
+		mesh.materialIDs[f] = obj.materialIDs[f] >= 0 ? (uint32_t)obj.materialIDs[f] : defaultMaterial;
 	}
+
+	return unique;
 }
 
-TriangleMesh::TriangleMesh(
-	RTCScene InScene, 
-	const std::vector<float>& p, 
-	const std::vector<float>& normals, 
-	const std::vector<float>& uvs,
-	const std::vector<int>& indices,
-	size_t numTriangles, 
-	size_t numVertices)
-	: scene(InScene)
+// Fills the shape's vertices in at firstVertex and moves its indices there.
+static void fillShapeVertices(const ObjData& obj, const ObjShape& shape, const std::vector<VertexKey>& unique, size_t firstVertex, MeshData& mesh)
 {
-	geomID = rtcNewTriangleMesh2(scene, RTC_GEOMETRY_STATIC, numTriangles, numVertices);
-
+	for (size_t v = 0; v < unique.size(); ++v)
 	{
-		Vertex* vertices = (Vertex*)rtcMapBuffer(scene, geomID, RTC_VERTEX_BUFFER);
-		assert(vertices);
-		for (size_t v = 0; v < numVertices; ++v)
+		const VertexKey& key = unique[v];
+		const size_t out = firstVertex + v;
+
+		const float* p = &obj.positions[3 * key.vertex];
+		mesh.positions[out] = Vertex{ p[0], p[1], p[2], 1.0f };
+
+		if (key.normal >= 0)
 		{
-			vertices[v].x = p[3 * v + 0];
-			vertices[v].y = p[3 * v + 1];
-			vertices[v].z = p[3 * v + 2];
-			vertices[v].w = 1.0f;
+			const float* n = &obj.normals[3 * key.normal];
+			mesh.normals[out] = Normal{ n[0], n[1], n[2] };
 		}
-		rtcUnmapBuffer(scene, geomID, RTC_VERTEX_BUFFER);
-	}
-	
-	if (uvs.size())
-	{
-		const size_t numBytes = uvs.size() * sizeof(float);
-		assert((uvs.size() / 2) == numVertices);
-		uv = static_cast<TextureCoord*>(_aligned_malloc(numBytes, alignment));
-		for (size_t v = 0; v < numVertices; ++v)
+		else
 		{
-			uv[v].u = uvs[2 * v + 0];
-			uv[v].v = uvs[2 * v + 1];
+			mesh.normals[out] = faceNormal(obj, (size_t)(-2 - key.normal));
+		}
+
+		if (key.texcoord >= 0)
+		{
+			const float* uv = &obj.texcoords[2 * key.texcoord];
+			mesh.texcoords[out] = TextureCoord{ uv[0], uv[1] };
+		}
+		else
+		{
+			mesh.texcoords[out] = TextureCoord{ 0.0f, 0.0f };
 		}
-		rtcSetBuffer2(scene, geomID, RTC_USER_VERTEX_BUFFER0, uv, 0, sizeof(TextureCoord), numVertices);
 	}
 
-	if (normals.size())
+	for (size_t f = shape.firstFace; f < shape.firstFace + shape.numFaces; ++f)
 	{
-		const size_t numBytes = normals.size() * sizeof(float);
-		assert((normals.size() / 3) == numVertices);
-		n = static_cast<Normal*>(_aligned_malloc(numBytes, alignment));
-		for (size_t v = 0; v < numVertices; ++v)
+		if (mesh.quads.empty())
 		{
-			n[v].x = normals[3 * v + 0];
-			n[v].y = normals[3 * v + 1];
-			n[v].z = normals[3 * v + 2];
+			Triangle& triangle = mesh.triangles[f];
+			triangle.v0 += (int)firstVertex;
+			triangle.v1 += (int)firstVertex;
+			triangle.v2 += (int)firstVertex;
 		}
-		rtcSetBuffer2(scene, geomID, RTC_USER_VERTEX_BUFFER1, n, 0, sizeof(Normal), numVertices);
+		else
+		{
+			Quad& quad = mesh.quads[f];
+			quad.v0 += (int)firstVertex;
+			quad.v1 += (int)firstVertex;
+			quad.v2 += (int)firstVertex;
+			quad.v3 += (int)firstVertex;
+		}
+	}
+}
+
+// Welds all shapes of the file straight into the buffers of one mesh, with
+// the file's material index per face. Files with any quads become a quad
+// mesh that holds its triangles as quads with a repeated last vertex, which
+// Embree supports. The first pass welds every shape on its own and fills the
+// index buffer, so the vertex buffers can be allocated at their exact size
+// and filled in a second pass without ever being grown or copied.
+static void weldObj(const ObjData& obj, MeshData& mesh)
+{
+	const size_t numFaces = obj.corners.size() / 4;
+	if (obj.hasQuads)
+	{
+		mesh.quads.allocate(numFaces);
+	}
+	else
+	{
+		mesh.triangles.allocate(numFaces);
+	}
+	mesh.materialIDs.allocate(numFaces);
+
+	std::vector<std::vector<VertexKey>> unique(obj.shapes.size());
+	tbb::parallel_for(size_t(0), obj.shapes.size(), [&obj, &mesh, &unique](size_t s)
+	{
+		unique[s] = weldShape(obj, obj.shapes[s], mesh);
+	});
+
+	std::vector<size_t> firstVertex(obj.shapes.size() + 1, 0);
+	for (size_t s = 0; s < obj.shapes.size(); ++s)
+	{
+		firstVertex[s + 1] = firstVertex[s] + unique[s].size();
+	}
+
+	const size_t numVertices = firstVertex.back();
+	mesh.positions.allocate(numVertices);
+	mesh.normals.allocate(numVertices);
+	mesh.texcoords.allocate(numVertices);
+
+	tbb::parallel_for(size_t(0), obj.shapes.size(), [&obj, &mesh, &unique, &firstVertex](size_t s)
+	{
+		fillShapeVertices(obj, obj.shapes[s], unique[s], firstVertex[s], mesh);
+	});
+}
+
+// Parses and welds the file, all its shapes go into one mesh, they only
+// differ by material. The parsed file is freed on return, before Embree builds.
+static bool loadObj(const std::string & Filename, MeshData& mesh, std::vector<Material>& materials)
+{
+	ObjData obj;
+	std::string err;
+	const bool ret = ParseObj(Filename, obj, err);
+
+	if (ret == false || obj.shapes.size() < 1)
+	{
+		std::cerr << err << std::endl;
+		return false;
+	}
+
+	// a file too big to weld fails on its own, the other files still load.
+	try
+	{
+		weldObj(obj, mesh);
 	}
-	
+	catch (const std::bad_alloc&)
 	{
-		Triangle* triangles = (Triangle*)rtcMapBuffer(scene, geomID, RTC_INDEX_BUFFER);
-		assert(triangles);
+		std::cerr << "Out of memory welding " << Filename << std::endl;
+		mesh = MeshData();
+		return false;
+	}
+
+	materials = objMaterials(obj);
+	return true;
+}
 
-		for (size_t i = 0; i < numTriangles; ++i)
+Mesh* LoadObjMesh(const std::string & Filename, RTCScene scene, MeshRegistry& registry, bool useCache, RTCGeometryFlags flags)
+{
+	useCache = useCache && flags == RTC_GEOMETRY_STATIC;
+	if (useCache)
+	{
+		if (Mesh* cached = LoadSceneCache(Filename, scene, registry))
 		{
-			triangles[i].v0 = indices[3 * i + 0];
-			triangles[i].v1 = indices[3 * i + 1];
-			triangles[i].v2 = indices[3 * i + 2];
+			return cached;
 		}
+	}
 
-		rtcUnmapBuffer(scene, geomID, RTC_INDEX_BUFFER);
+	MeshData mesh;
+	std::vector<Material> materials;
+	if (!loadObj(Filename, mesh, materials))
+	{
+		return nullptr;
+	}
+
+	if (useCache && !WriteSceneCache(Filename, mesh, materials))
+	{
+		std::cerr << "Failed to write scene cache for " << Filename << std::endl;
 	}
+
+	registry.remapMaterialIDs(registry.addMaterials(materials), mesh.materialIDs);
+	Mesh* added = new Mesh(std::move(mesh));
+	registry.add(scene, added, flags);
+	return added;
+}
+
+bool LoadObjMeshData(const std::string & Filename, MeshData& mesh)
+{
+	std::vector<Material> materials;
+	return loadObj(Filename, mesh, materials);
 }
 
-TriangleMesh::~TriangleMesh()
+void LoadObjMeshes(const std::vector<std::string>& Filenames, RTCScene scene, MeshRegistry& registry, bool useCache)
 {
-	if (n)
+	// one task per file, each of them parses and welds in parallel itself.
+	tbb::parallel_for(size_t(0), Filenames.size(), [&Filenames, scene, &registry, useCache](size_t i)
 	{
-		_aligned_free(n);
+		LoadObjMesh(Filenames[i], scene, registry, useCache);
+	});
+}
+
+Mesh::Mesh(MeshData&& InData)
+	: data(std::move(InData))
+{
+	p = data.positions.data();
+	n = data.normals.data();
+	uv = data.texcoords.data();
+	triangles = data.triangles.data();
+	quads = data.quads.data();
+	materialIDs = data.materialIDs.data();
+	numPrimitives = data.materialIDs.size();
+	numVertices = data.positions.size();
+}
+
+Mesh::Mesh(
+	std::shared_ptr<const MappedFile> InBacking,
+	const Vertex* inP,
+	const Normal* inN,
+	const TextureCoord* inUV,
+	const Triangle* inTriangles,
+	const Quad* inQuads,
+	AlignedBuffer<uint32_t>&& inMaterialIDs,
+	size_t inNumVertices)
+	: backing(std::move(InBacking)), p(inP), n(inN), uv(inUV), triangles(inTriangles), quads(inQuads), numVertices(inNumVertices)
+{
+	data.materialIDs = std::move(inMaterialIDs);
+	materialIDs = data.materialIDs.data();
+	numPrimitives = data.materialIDs.size();
+}
+
+unsigned Mesh::addToScene(RTCScene InScene, RTCGeometryFlags flags)
+{
+	scene = InScene;
+	if (quads)
+	{
+		geomID = rtcNewQuadMesh2(scene, flags, numPrimitives, numVertices);
+		rtcSetBuffer2(scene, geomID, RTC_INDEX_BUFFER, quads, 0, sizeof(Quad), numPrimitives);
 	}
-	if (uv)
+	else
 	{
-		_aligned_free(uv);
+		geomID = rtcNewTriangleMesh2(scene, flags, numPrimitives, numVertices);
+		rtcSetBuffer2(scene, geomID, RTC_INDEX_BUFFER, triangles, 0, sizeof(Triangle), numPrimitives);
 	}
+
+	rtcSetBuffer2(scene, geomID, RTC_VERTEX_BUFFER, p, 0, sizeof(Vertex), numVertices);
+	rtcSetBuffer2(scene, geomID, RTC_USER_VERTEX_BUFFER0, uv, 0, sizeof(TextureCoord), numVertices);
+	rtcSetBuffer2(scene, geomID, RTC_USER_VERTEX_BUFFER1, n, 0, sizeof(Normal), numVertices);
+
+	// the renderer finds the material of a hit through the geometry's user data.
+	rtcSetUserData(scene, geomID, const_cast<uint32_t*>(materialIDs));
+
+	return geomID;
+}
+
+bool Mesh::updateVertices(const MeshData& frame)
+{
+	if (backing || frame.positions.size() != numVertices || frame.normals.size() != numVertices || frame.materialIDs.size() != numPrimitives)
+	{
+		return false;
+	}
+
+	// the same counts can still hide another vertex order or connectivity.
+	const bool sameTriangles = triangles && frame.triangles.size() == numPrimitives && std::memcmp(triangles, frame.triangles.data(), frame.triangles.bytes()) == 0;
+	const bool sameQuads = quads && frame.quads.size() == numPrimitives && std::memcmp(quads, frame.quads.data(), frame.quads.bytes()) == 0;
+	if (!sameTriangles && !sameQuads)
+	{
+		return false;
+	}
+
+	std::memcpy(data.positions.data(), frame.positions.data(), frame.positions.bytes());
+	std::memcpy(data.normals.data(), frame.normals.data(), frame.normals.bytes());
+	rtcUpdateBuffer(scene, geomID, RTC_VERTEX_BUFFER);
+	rtcUpdateBuffer(scene, geomID, RTC_USER_VERTEX_BUFFER1);
+	return true;
+}
+
+MeshRegistry::MeshRegistry(std::vector<Mesh*>& InMeshes, std::vector<Material>& InMaterials)
+	: meshes(InMeshes), materials(InMaterials)
+{
+}
+
+void MeshRegistry::add(RTCScene scene, Mesh* mesh, RTCGeometryFlags flags)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	mesh->addToScene(scene, flags);
+	meshes.push_back(mesh);
+}
+
+std::vector<uint32_t> MeshRegistry::addMaterials(const std::vector<Material>& fileMaterials)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::vector<uint32_t> ids;
+	for (const Material& material : fileMaterials)
+	{
+		// materials are only told apart by their parameters, names don't matter.
+		const auto same = std::find_if(materials.begin(), materials.end(), [&material](const Material& m)
+		{
+			return std::memcmp(m.DiffuseColor, material.DiffuseColor, sizeof(m.DiffuseColor)) == 0;
+		});
+
+		ids.push_back((uint32_t)(same - materials.begin()));
+		if (same == materials.end())
+		{
+			materials.push_back(material);
+		}
+	}
+
+	return ids;
+}
+
+void MeshRegistry::remapMaterialIDs(const std::vector<uint32_t>& ids, AlignedBuffer<uint32_t>& materialIDs)
+{
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, materialIDs.size()), [&ids, &materialIDs](const tbb::blocked_range<size_t>& r)
+	{
+		for (size_t t = r.begin(); t != r.end(); ++t)
+		{
+			materialIDs[t] = ids[materialIDs[t]];
+		}
+	});
 }
@@ -1,32 +1,119 @@
 #pragma once
+#include <stdint.h>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <embree2/rtcore.h>
 
+#include "AlignedBuffer.h"
 #include "Material.h"
 
-class TriangleMesh
+class MappedFile;
+
+struct Vertex { float x, y, z, w; };
+struct Normal { float x, y, z; };
+struct TextureCoord { float u, v; };
+struct Triangle { int v0, v1, v2; };
+struct Quad { int v0, v1, v2, v3; };
+
+// Welded geometry in the layout Embree reads, as stored in the scene cache.
+// Only one of triangles and quads is used; quad meshes hold their triangles
+// as quads whose last two indices are equal. materialIDs holds the material
+// of each primitive.
+struct MeshData
+{
+	AlignedBuffer<Vertex> positions;
+	AlignedBuffer<Normal> normals;
+	AlignedBuffer<TextureCoord> texcoords;
+	AlignedBuffer<Triangle> triangles;
+	AlignedBuffer<Quad> quads;
+	AlignedBuffer<uint32_t> materialIDs;
+};
+
+// Triangle or quad geometry whose buffers are shared with Embree through
+// rtcSetBuffer2 rather than copied into Embree owned ones. The mesh keeps
+// whatever holds the buffers alive for as long as the geometry exists.
+class Mesh
 {
 	// Embree Data
 	unsigned geomID = RTC_INVALID_GEOMETRY_ID;
 	RTCScene scene = nullptr;
 
+	// buffers owned by the mesh, empty when they live in a mapped file.
+	MeshData data;
+	std::shared_ptr<const MappedFile> backing;
+
 	// Vertex Streams
-	struct Normal* n = nullptr;
-	struct TextureCoord* uv = nullptr;
+	const Vertex* p = nullptr;
+	const Normal* n = nullptr;
+	const TextureCoord* uv = nullptr;
+	const Triangle* triangles = nullptr;
+	const Quad* quads = nullptr;
+	const uint32_t* materialIDs = nullptr;
+	size_t numPrimitives = 0;
+	size_t numVertices = 0;
 
 public:
-	TriangleMesh() = default;
-	~TriangleMesh();
-	TriangleMesh(
-		RTCScene InScene,
-		const std::vector<float>& inP,
-		const std::vector<float>& inN,
-		const std::vector<float>& inUV,
-		const std::vector<int>& inIndices, 
-		size_t numTriangles, 
-		size_t numVertices);
+	Mesh() = default;
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
+
+	explicit Mesh(MeshData&& InData);
+
+	// Shares buffers that live in a mapped file, only the material IDs are owned.
+	// One of inTriangles and inQuads is null.
+	Mesh(
+		std::shared_ptr<const MappedFile> InBacking,
+		const Vertex* inP,
+		const Normal* inN,
+		const TextureCoord* inUV,
+		const Triangle* inTriangles,
+		const Quad* inQuads,
+		AlignedBuffer<uint32_t>&& inMaterialIDs,
+		size_t inNumVertices);
+
+	// Creates the Embree geometry and returns its ID. The geometry's user data
+	// points to the per triangle material IDs.
+	unsigned addToScene(RTCScene InScene, RTCGeometryFlags flags = RTC_GEOMETRY_STATIC);
+
+	// Replaces positions and normals with those of another frame of the same
+	// topology, i.e. identical indices. Only for owned buffers of deformable
+	// geometry, Embree refits its BVH on the next commit.
+	bool updateVertices(const MeshData& frame);
 };
 
-void LoadObjMesh(const std::string & Filename, RTCScene scene, std::vector<TriangleMesh*>& OutMeshes, std::vector<Material>& OutMaterials);
+// Adds meshes to scenes, keeps them for deletion and collects the materials
+// they use into one table without duplicates. Safe to use from several
+// threads at once.
+class MeshRegistry
+{
+public:
+	MeshRegistry(std::vector<Mesh*>& InMeshes, std::vector<Material>& InMaterials);
+	MeshRegistry() = delete;
+
+	void add(RTCScene scene, Mesh* mesh, RTCGeometryFlags flags = RTC_GEOMETRY_STATIC);
+
+	// Adds a file's materials to the table and returns the table index of each.
+	std::vector<uint32_t> addMaterials(const std::vector<Material>& fileMaterials);
+	// Turns material indices of a file into table indices.
+	static void remapMaterialIDs(const std::vector<uint32_t>& ids, AlignedBuffer<uint32_t>& materialIDs);
+
+private:
+	std::mutex mutex;
+	std::vector<Mesh*>& meshes;
+	std::vector<Material>& materials;
+};
+
+// Returns the added mesh, or null if the file couldn't be loaded or its buffers
+// couldn't be allocated. Deformable meshes never use the scene cache, their
+// vertices are rewritten per frame.
+Mesh* LoadObjMesh(const std::string & Filename, RTCScene scene, MeshRegistry& registry, bool useCache = true, RTCGeometryFlags flags = RTC_GEOMETRY_STATIC);
+
+// Parses and welds the file without adding it anywhere, e.g. as a later
+// frame of an animated mesh.
+bool LoadObjMeshData(const std::string & Filename, MeshData& mesh);
+
+// Loads the files in parallel on the TBB pool.
+void LoadObjMeshes(const std::vector<std::string>& Filenames, RTCScene scene, MeshRegistry& registry, bool useCache = true);
@@ -0,0 +1,541 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include "tbb/tbb.h"
+
+#include "MappedFile.h"
+#include "ObjParser.h"
+
+/* smallest amount of text worth a task of its own */
+static const size_t OBJ_MIN_CHUNK_SIZE{ 1 << 20 };
+
+// Corner indices that are relative to the end of the chunk's own attribute
+// lists until the chunks are merged.
+enum RelativeIndex : uint8_t
+{
+	RelativeVertex = 1,
+	RelativeTexcoord = 2,
+	RelativeNormal = 4
+};
+
+// What one chunk of the file parsed to, with indices local to the chunk
+// where the file used negative (relative) indices.
+struct ObjChunk
+{
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+	std::vector<ObjCorner> corners;
+	std::vector<uint8_t> relative;
+
+	// per face index into materialNames, -1 until the chunk's first usemtl.
+	std::vector<int> materials;
+	std::vector<std::string> materialNames;
+	int currentMaterial = -1;
+
+	// face index at which each "o" or "g" statement started a new shape.
+	std::vector<std::pair<size_t, std::string>> shapeStarts;
+	std::vector<std::string> materialLibraries;
+	bool hasQuads = false;
+};
+
+static bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void skipSpaces(const char*& p, const char* end)
+{
+	while (p < end && isSpace(*p))
+	{
+		++p;
+	}
+}
+
+static bool parseInt(const char*& p, const char* end, int& value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		++p;
+	}
+
+	if (p == end || *p < '0' || *p > '9')
+	{
+		return false;
+	}
+
+	int result = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		result = result * 10 + (*p - '0');
+		++p;
+	}
+
+	value = negative ? -result : result;
+	return true;
+}
+
+// strtod would need a terminated string and is locale dependent.
+static bool parseFloat(const char*& p, const char* end, float& value)
+{
+	skipSpaces(p, end);
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		++p;
+	}
+
+	double mantissa = 0.0;
+	int exponent = 0;
+	bool digits = false;
+
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa * 10.0 + (*p - '0');
+		digits = true;
+		++p;
+	}
+
+	if (p < end && *p == '.')
+	{
+		++p;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			mantissa = mantissa * 10.0 + (*p - '0');
+			exponent--;
+			digits = true;
+			++p;
+		}
+	}
+
+	if (!digits)
+	{
+		return false;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		int e = 0;
+		if (!parseInt(p, end, e))
+		{
+			return false;
+		}
+		exponent += e;
+	}
+
+	const double result = exponent != 0 ? mantissa * std::pow(10.0, exponent) : mantissa;
+	value = (float)(negative ? -result : result);
+	return true;
+}
+
+static bool parseFloats(const char*& p, const char* end, std::vector<float>& out, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		float value;
+		if (!parseFloat(p, end, value))
+		{
+			return false;
+		}
+		out.push_back(value);
+	}
+	return true;
+}
+
+// The rest of the line without surrounding whitespace.
+static std::string parseName(const char* p, const char* end)
+{
+	skipSpaces(p, end);
+	while (end > p && isSpace(end[-1]))
+	{
+		--end;
+	}
+	return std::string(p, end);
+}
+
+// Turns a 1 based or negative OBJ index into a 0 based one, negative indices
+// stay relative to the chunk until it is merged.
+static int resolveIndex(int index, size_t count, uint8_t flag, uint8_t& relative)
+{
+	if (index < 0)
+	{
+		relative |= flag;
+		return (int)count + index;
+	}
+	return index - 1;
+}
+
+static bool parseFace(const char* p, const char* end, ObjChunk& chunk)
+{
+	static thread_local std::vector<ObjCorner> face;
+	static thread_local std::vector<uint8_t> faceRelative;
+	face.clear();
+	faceRelative.clear();
+
+	for (;;)
+	{
+		skipSpaces(p, end);
+		if (p == end)
+		{
+			break;
+		}
+
+		ObjCorner corner{ -1, -1, -1 };
+		uint8_t relative = 0;
+
+		int index;
+		if (!parseInt(p, end, index))
+		{
+			return false;
+		}
+		corner.vertex = resolveIndex(index, chunk.positions.size() / 3, RelativeVertex, relative);
+
+		if (p < end && *p == '/')
+		{
+			++p;
+			if (p < end && *p != '/')
+			{
+				if (!parseInt(p, end, index))
+				{
+					return false;
+				}
+				corner.texcoord = resolveIndex(index, chunk.texcoords.size() / 2, RelativeTexcoord, relative);
+			}
+
+			if (p < end && *p == '/')
+			{
+				++p;
+				if (!parseInt(p, end, index))
+				{
+					return false;
+				}
+				corner.normal = resolveIndex(index, chunk.normals.size() / 3, RelativeNormal, relative);
+			}
+		}
+
+		face.push_back(corner);
+		faceRelative.push_back(relative);
+	}
+
+	if (face.size() < 3)
+	{
+		return false;
+	}
+
+	if (face.size() == 4)
+	{
+		for (size_t c = 0; c < 4; ++c)
+		{
+			chunk.corners.push_back(face[c]);
+			chunk.relative.push_back(faceRelative[c]);
+		}
+		chunk.materials.push_back(chunk.currentMaterial);
+		chunk.hasQuads = true;
+		return true;
+	}
+
+	for (size_t i = 1; i + 1 < face.size(); ++i)
+	{
+		const size_t fan[4] = { 0, i, i + 1, i + 1 };
+		for (size_t c : fan)
+		{
+			chunk.corners.push_back(face[c]);
+			chunk.relative.push_back(faceRelative[c]);
+		}
+		chunk.materials.push_back(chunk.currentMaterial);
+	}
+
+	return true;
+}
+
+static bool startsWith(const char* p, const char* end, const char* keyword)
+{
+	const size_t length = std::strlen(keyword);
+	return (size_t)(end - p) > length && std::strncmp(p, keyword, length) == 0 && isSpace(p[length]);
+}
+
+static bool parseLine(const char* p, const char* end, ObjChunk& chunk)
+{
+	skipSpaces(p, end);
+	if (p == end || *p == '#')
+	{
+		return true;
+	}
+
+	if (startsWith(p, end, "v"))
+	{
+		p += 2;
+		return parseFloats(p, end, chunk.positions, 3);
+	}
+	if (startsWith(p, end, "vn"))
+	{
+		p += 3;
+		return parseFloats(p, end, chunk.normals, 3);
+	}
+	if (startsWith(p, end, "vt"))
+	{
+		// an optional third coordinate is ignored.
+		p += 3;
+		return parseFloats(p, end, chunk.texcoords, 2);
+	}
+	if (startsWith(p, end, "f"))
+	{
+		return parseFace(p + 2, end, chunk);
+	}
+	if (startsWith(p, end, "usemtl"))
+	{
+		chunk.currentMaterial = (int)chunk.materialNames.size();
+		chunk.materialNames.push_back(parseName(p + 7, end));
+		return true;
+	}
+	if (startsWith(p, end, "mtllib"))
+	{
+		p += 7;
+		for (;;)
+		{
+			skipSpaces(p, end);
+			const char* name = p;
+			while (p < end && !isSpace(*p))
+			{
+				++p;
+			}
+			if (p == name)
+			{
+				break;
+			}
+			chunk.materialLibraries.push_back(std::string(name, p));
+		}
+		return true;
+	}
+	if (startsWith(p, end, "o") || startsWith(p, end, "g"))
+	{
+		// groups with several names are named after the first one.
+		const char* name = p + 2;
+		skipSpaces(name, end);
+		const char* nameEnd = name;
+		while (nameEnd < end && !isSpace(*nameEnd))
+		{
+			++nameEnd;
+		}
+		chunk.shapeStarts.push_back(std::make_pair(chunk.materials.size(), std::string(name, nameEnd)));
+		return true;
+	}
+
+	// smoothing groups, parameter space vertices, lines and the like are skipped.
+	return true;
+}
+
+static bool parseChunk(const char* begin, const char* end, ObjChunk& chunk)
+{
+	const char* p = begin;
+	while (p < end)
+	{
+		const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		if (!lineEnd)
+		{
+			lineEnd = end;
+		}
+
+		if (!parseLine(p, lineEnd, chunk))
+		{
+			return false;
+		}
+
+		p = lineEnd + 1;
+	}
+
+	return true;
+}
+
+static void loadMaterialLibraries(const std::string& Filename, const std::vector<ObjChunk>& chunks, std::map<std::string, int>& materialMap, std::vector<tinyobj::material_t>& materials, std::string& err)
+{
+	// libraries are named relative to the OBJ file.
+	const size_t slash = Filename.find_last_of("/\\");
+	const std::string directory = slash == std::string::npos ? std::string() : Filename.substr(0, slash + 1);
+
+	for (const ObjChunk& chunk : chunks)
+	{
+		for (const std::string& library : chunk.materialLibraries)
+		{
+			std::ifstream stream(directory + library);
+			if (!stream)
+			{
+				err += "Failed to open material library " + library + "\n";
+				continue;
+			}
+
+			std::string warning;
+			tinyobj::LoadMtl(&materialMap, &materials, &stream, &warning);
+			err += warning;
+		}
+	}
+}
+
+bool ParseObj(const std::string& Filename, ObjData& Out, std::string& err)
+{
+	MappedFile file;
+	if (!file.open(Filename))
+	{
+		err += "Failed to open " + Filename + "\n";
+		return false;
+	}
+
+	const char* text = file.data();
+	const size_t size = file.size();
+
+	// split into line aligned chunks, a few per worker thread for load balancing.
+	const size_t maxChunks = (size_t)tbb::task_scheduler_init::default_num_threads() * 4;
+	const size_t numChunks = std::max<size_t>(1, std::min(maxChunks, size / OBJ_MIN_CHUNK_SIZE));
+
+	std::vector<size_t> bounds(numChunks + 1, size);
+	bounds[0] = 0;
+	for (size_t c = 1; c < numChunks; ++c)
+	{
+		size_t offset = std::max(bounds[c - 1], size / numChunks * c);
+		const char* newline = offset < size ? static_cast<const char*>(std::memchr(text + offset, '\n', size - offset)) : nullptr;
+		bounds[c] = newline ? (size_t)(newline - text) + 1 : size;
+	}
+
+	std::vector<ObjChunk> chunks(numChunks);
+	std::atomic<bool> parsed{ true };
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1), [&](const tbb::blocked_range<size_t>& r)
+	{
+		for (size_t c = r.begin(); c != r.end(); ++c)
+		{
+			if (!parseChunk(text + bounds[c], text + bounds[c + 1], chunks[c]))
+			{
+				parsed = false;
+			}
+		}
+	});
+
+	if (!parsed)
+	{
+		err += "Malformed line in " + Filename + "\n";
+		return false;
+	}
+
+	std::map<std::string, int> materialMap;
+	loadMaterialLibraries(Filename, chunks, materialMap, Out.materials, err);
+
+	// where each chunk's data starts in the merged arrays, and the material
+	// in effect when the chunk begins.
+	struct ChunkOffsets
+	{
+		size_t positions = 0, normals = 0, texcoords = 0, faces = 0;
+		int material = -1;
+		std::vector<int> materialIDs;
+	};
+
+	std::vector<ChunkOffsets> offsets(numChunks + 1);
+	for (size_t c = 0; c < numChunks; ++c)
+	{
+		const ObjChunk& chunk = chunks[c];
+		ChunkOffsets& current = offsets[c];
+		ChunkOffsets& next = offsets[c + 1];
+
+		for (const std::string& name : chunk.materialNames)
+		{
+			const auto found = materialMap.find(name);
+			current.materialIDs.push_back(found != materialMap.end() ? found->second : -1);
+		}
+
+		next.positions = current.positions + chunk.positions.size();
+		next.normals = current.normals + chunk.normals.size();
+		next.texcoords = current.texcoords + chunk.texcoords.size();
+		next.faces = current.faces + chunk.materials.size();
+		next.material = chunk.currentMaterial >= 0 ? current.materialIDs[chunk.currentMaterial] : current.material;
+
+		Out.hasQuads = Out.hasQuads || chunk.hasQuads;
+	}
+
+	const ChunkOffsets& total = offsets[numChunks];
+	Out.positions.resize(total.positions);
+	Out.normals.resize(total.normals);
+	Out.texcoords.resize(total.texcoords);
+	Out.corners.resize(total.faces * 4);
+	Out.materialIDs.resize(total.faces);
+
+	const int numPositions = (int)(total.positions / 3);
+	const int numNormals = (int)(total.normals / 3);
+	const int numTexcoords = (int)(total.texcoords / 2);
+
+	std::atomic<bool> valid{ true };
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1), [&](const tbb::blocked_range<size_t>& r)
+	{
+		for (size_t c = r.begin(); c != r.end(); ++c)
+		{
+			const ObjChunk& chunk = chunks[c];
+			const ChunkOffsets& offset = offsets[c];
+
+			std::copy(chunk.positions.begin(), chunk.positions.end(), Out.positions.begin() + offset.positions);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), Out.normals.begin() + offset.normals);
+			std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), Out.texcoords.begin() + offset.texcoords);
+
+			const int positionBase = (int)(offset.positions / 3);
+			const int normalBase = (int)(offset.normals / 3);
+			const int texcoordBase = (int)(offset.texcoords / 2);
+
+			for (size_t i = 0; i < chunk.corners.size(); ++i)
+			{
+				ObjCorner corner = chunk.corners[i];
+				const uint8_t relative = chunk.relative[i];
+				corner.vertex += (relative & RelativeVertex) ? positionBase : 0;
+				corner.texcoord += (relative & RelativeTexcoord) ? texcoordBase : 0;
+				corner.normal += (relative & RelativeNormal) ? normalBase : 0;
+
+				if (corner.vertex < 0 || corner.vertex >= numPositions || corner.texcoord >= numTexcoords || corner.normal >= numNormals
+					|| ((relative & RelativeTexcoord) && corner.texcoord < 0) || ((relative & RelativeNormal) && corner.normal < 0))
+				{
+					valid = false;
+				}
+
+				Out.corners[offset.faces * 4 + i] = corner;
+			}
+
+			for (size_t f = 0; f < chunk.materials.size(); ++f)
+			{
+				const int local = chunk.materials[f];
+				Out.materialIDs[offset.faces + f] = local >= 0 ? offset.materialIDs[local] : offset.material;
+			}
+		}
+	});
+
+	if (!valid)
+	{
+		err += "Face index out of range in " + Filename + "\n";
+		return false;
+	}
+
+	// shapes run from one "o" or "g" statement to the next, empty ones are dropped.
+	std::vector<std::pair<size_t, std::string>> shapeStarts(1, std::make_pair((size_t)0, std::string()));
+	for (size_t c = 0; c < numChunks; ++c)
+	{
+		for (const auto& start : chunks[c].shapeStarts)
+		{
+			shapeStarts.push_back(std::make_pair(offsets[c].faces + start.first, start.second));
+		}
+	}
+	shapeStarts.push_back(std::make_pair(total.faces, std::string()));
+
+	for (size_t s = 0; s + 1 < shapeStarts.size(); ++s)
+	{
+		const size_t first = shapeStarts[s].first;
+		const size_t last = shapeStarts[s + 1].first;
+		if (last > first)
+		{
+			Out.shapes.push_back(ObjShape{ shapeStarts[s].second, first, last - first });
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "tiny_obj_loader.h"
+
+// One face corner. Indices are 0 based, -1 when the corner has no such attribute.
+struct ObjCorner
+{
+	int vertex;
+	int texcoord;
+	int normal;
+};
+
+// Faces between two "o" or "g" statements.
+struct ObjShape
+{
+	std::string name;
+	size_t firstFace;
+	size_t numFaces;
+};
+
+// Contents of an OBJ file. Triangles and quads are kept as they are, larger
+// polygons are triangulated as fans.
+struct ObjData
+{
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+	// four corners per face, triangles repeat their last corner.
+	std::vector<ObjCorner> corners;
+	// material of each face, -1 for none.
+	std::vector<int> materialIDs;
+	std::vector<ObjShape> shapes;
+	bool hasQuads = false;
+	std::vector<tinyobj::material_t> materials;
+};
+
+// Memory maps the file, splits it into line aligned chunks and tokenizes them
+// in parallel. Chunks are merged straight into the final arrays. Material
+// libraries are read with tinyobj.
+bool ParseObj(const std::string& Filename, ObjData& Out, std::string& err);
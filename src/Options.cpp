@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+#include "Animation.h"
+#include "Options.h"
+
+struct SceneFlagName
+{
+	int flag;
+	const char* name;
+};
+
+static const SceneFlagName SCENE_FLAG_NAMES[] =
+{
+	{ RTC_SCENE_DYNAMIC, "dynamic" },
+	{ RTC_SCENE_COMPACT, "compact" },
+	{ RTC_SCENE_COHERENT, "coherent" },
+	{ RTC_SCENE_INCOHERENT, "incoherent" },
+	{ RTC_SCENE_HIGH_QUALITY, "high-quality" },
+	{ RTC_SCENE_ROBUST, "robust" },
+};
+
+std::string SceneFlagsName(int sceneFlags)
+{
+	std::string names = (sceneFlags & RTC_SCENE_DYNAMIC) ? "" : "static";
+	for (const SceneFlagName& flag : SCENE_FLAG_NAMES)
+	{
+		if (sceneFlags & flag.flag)
+		{
+			names += (names.empty() ? "" : ",") + std::string(flag.name);
+		}
+	}
+	return names;
+}
+
+bool ParseSceneFlags(const std::string& names, int& sceneFlags)
+{
+	sceneFlags = RTC_SCENE_STATIC;
+	std::istringstream list(names);
+	std::string name;
+	while (std::getline(list, name, ','))
+	{
+		if (name == "static")
+		{
+			continue;
+		}
+
+		const SceneFlagName* match = std::find_if(std::begin(SCENE_FLAG_NAMES), std::end(SCENE_FLAG_NAMES), [&name](const SceneFlagName& flag)
+		{
+			return name == flag.name;
+		});
+		if (match == std::end(SCENE_FLAG_NAMES))
+		{
+			std::cout << "Unknown scene flag " << name << "\n";
+			return false;
+		}
+		sceneFlags |= match->flag;
+	}
+	return true;
+}
+
+void PrintUsage(const char* program)
+{
+	std::cout << "Usage: " << program << " [options] input1.obj input2.obj input3.obj|scene.scene\n"
+		<< "Options:\n"
+		<< "  --headless          render without a window and exit when done\n"
+		<< "  --spp N             stop after N samples per pixel (headless)\n"
+		<< "  --time-budget S     stop after S seconds of rendering (headless)\n"
+		<< "  --width W           image width (default 512)\n"
+		<< "  --height H          image height (default 512)\n"
+		<< "  --out FILE          output image (default color.hdr)\n"
+		<< "  --max-depth N       maximum path length (default 8)\n"
+		<< "  --rr-depth N        path length at which Russian roulette starts (default 3)\n"
+		<< "  --sampling MODE     bounce sampling, uniform or cosine (default cosine)\n"
+		<< "  --wavefront         use the breadth first ray stream integrator\n"
+		<< "  --packets           trace camera rays as 8 or 16 wide packets\n"
+		<< "  --immediate-shadows trace shadow rays one at a time instead of in batches\n"
+		<< "  --no-hit-cache      retrace camera rays every iteration\n"
+		<< "  --adaptive T        stop sampling pixels whose relative error is below T\n"
+		<< "  --adaptive-min-spp N  samples every pixel gets before it may stop (default 16)\n"
+		<< "  --tile-size N       render N x N pixel tiles instead of the calibrated size\n"
+		<< "  --pixel-order MODE  pixel order within a tile, scanline or zorder\n"
+		<< "  --calibrate         measure the tile layout again and update the profile\n"
+		<< "  --tile-profile FILE machine tile profile (default tiles.profile)\n"
+		<< "  --no-scene-cache    always parse the OBJ files, don't read or write .cache files\n"
+		<< "  --split-scene       build one BVH per input file in parallel and instance them\n"
+		<< "  --memory-budget MB  limit on meshes, BVH and image memory, a compact BVH is used to stay under it\n"
+		<< "  --scene-flags LIST  BVH kind, comma separated: static or dynamic, compact, coherent, incoherent,\n"
+		<< "                      high-quality, robust (default static)\n"
+		<< "  --benchmark-build   time scene builds and tracing with several scene flags and use the best\n"
+		<< "  --frames FIRST LAST frames of inputs given as patterns like walk.%04d.obj (headless)\n"
+		<< "  --transform-track FILE  per frame instance transforms applied over the frames (headless)\n";
+}
+
+static bool readUInt(int& i, int argc, char* argv[], uint32_t& value)
+{
+	if (i + 1 >= argc)
+	{
+		std::cout << "Missing value for " << argv[i] << "\n";
+		return false;
+	}
+
+	// strtoull would take an empty string as 0 and wrap a leading '-', so only
+	// plain digits are accepted. unsigned long is 32 bits on Windows.
+	const char* text = argv[++i];
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long long parsed = std::isdigit((unsigned char)text[0]) ? std::strtoull(text, &end, 10) : 0;
+	if (end == nullptr || end == text || *end != '\0' || errno == ERANGE || parsed > UINT32_MAX)
+	{
+		std::cout << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+		return false;
+	}
+
+	value = (uint32_t)parsed;
+	return true;
+}
+
+static bool readDouble(int& i, int argc, char* argv[], double& value)
+{
+	if (i + 1 >= argc)
+	{
+		std::cout << "Missing value for " << argv[i] << "\n";
+		return false;
+	}
+
+	char* end = nullptr;
+	value = std::strtod(argv[++i], &end);
+	if (end == argv[i] || *end != '\0')
+	{
+		std::cout << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+static bool readString(int& i, int argc, char* argv[], std::string& value)
+{
+	if (i + 1 >= argc)
+	{
+		std::cout << "Missing value for " << argv[i] << "\n";
+		return false;
+	}
+
+	value = argv[++i];
+	return true;
+}
+
+bool ParseCommandLine(int argc, char* argv[], RenderOptions& options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		bool ok = true;
+
+		if (std::strcmp(arg, "--headless") == 0)
+		{
+			options.headless = true;
+		}
+		else if (std::strcmp(arg, "--spp") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.spp);
+		}
+		else if (std::strcmp(arg, "--time-budget") == 0)
+		{
+			ok = readDouble(i, argc, argv, options.timeBudget);
+		}
+		else if (std::strcmp(arg, "--width") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.width);
+		}
+		else if (std::strcmp(arg, "--height") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.height);
+		}
+		else if (std::strcmp(arg, "--out") == 0)
+		{
+			ok = readString(i, argc, argv, options.output);
+		}
+		else if (std::strcmp(arg, "--max-depth") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.integrator.maxDepth);
+		}
+		else if (std::strcmp(arg, "--rr-depth") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.integrator.rouletteDepth);
+		}
+		else if (std::strcmp(arg, "--wavefront") == 0)
+		{
+			options.wavefront = true;
+		}
+		else if (std::strcmp(arg, "--immediate-shadows") == 0)
+		{
+			options.immediateShadows = true;
+		}
+		else if (std::strcmp(arg, "--no-hit-cache") == 0)
+		{
+			options.hitCache = false;
+		}
+		else if (std::strcmp(arg, "--packets") == 0)
+		{
+			options.packets = true;
+		}
+		else if (std::strcmp(arg, "--adaptive") == 0)
+		{
+			double threshold = 0.0;
+			ok = readDouble(i, argc, argv, threshold);
+			options.adaptive.enabled = true;
+			options.adaptive.threshold = (float)threshold;
+		}
+		else if (std::strcmp(arg, "--adaptive-min-spp") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.adaptive.minSamples);
+		}
+		else if (std::strcmp(arg, "--no-scene-cache") == 0)
+		{
+			options.sceneCache = false;
+		}
+		else if (std::strcmp(arg, "--split-scene") == 0)
+		{
+			options.splitScene = true;
+		}
+		else if (std::strcmp(arg, "--memory-budget") == 0)
+		{
+			uint32_t megabytes = 0;
+			ok = readUInt(i, argc, argv, megabytes);
+			options.memoryBudget = (uint64_t)megabytes * 1024 * 1024;
+		}
+		else if (std::strcmp(arg, "--tile-size") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.tiles.size);
+			options.fixedTileSize = true;
+			if (ok && options.tiles.size == 0)
+			{
+				std::cout << "Tile size must be at least 1\n";
+				ok = false;
+			}
+		}
+		else if (std::strcmp(arg, "--pixel-order") == 0)
+		{
+			std::string mode;
+			ok = readString(i, argc, argv, mode);
+			options.fixedPixelOrder = true;
+			if (ok && mode == "scanline")
+			{
+				options.tiles.order = PixelOrder::Scanline;
+			}
+			else if (ok && mode == "zorder")
+			{
+				options.tiles.order = PixelOrder::ZOrder;
+			}
+			else if (ok)
+			{
+				std::cout << "Unknown pixel order " << mode << "\n";
+				ok = false;
+			}
+		}
+		else if (std::strcmp(arg, "--scene-flags") == 0)
+		{
+			std::string names;
+			ok = readString(i, argc, argv, names) && ParseSceneFlags(names, options.sceneFlags);
+		}
+		else if (std::strcmp(arg, "--benchmark-build") == 0)
+		{
+			options.benchmarkBuild = true;
+		}
+		else if (std::strcmp(arg, "--frames") == 0)
+		{
+			ok = readUInt(i, argc, argv, options.firstFrame) && readUInt(i, argc, argv, options.lastFrame);
+		}
+		else if (std::strcmp(arg, "--transform-track") == 0)
+		{
+			ok = readString(i, argc, argv, options.transformTrack);
+		}
+		else if (std::strcmp(arg, "--calibrate") == 0)
+		{
+			options.calibrate = true;
+		}
+		else if (std::strcmp(arg, "--tile-profile") == 0)
+		{
+			ok = readString(i, argc, argv, options.tileProfile);
+		}
+		else if (std::strcmp(arg, "--sampling") == 0)
+		{
+			std::string mode;
+			ok = readString(i, argc, argv, mode);
+			if (ok && mode == "uniform")
+			{
+				options.integrator.sampling = Sampling::Strategy::Uniform;
+			}
+			else if (ok && mode == "cosine")
+			{
+				options.integrator.sampling = Sampling::Strategy::Cosine;
+			}
+			else if (ok)
+			{
+				std::cout << "Unknown sampling mode " << mode << "\n";
+				ok = false;
+			}
+		}
+		else if (std::strncmp(arg, "--", 2) == 0)
+		{
+			std::cout << "Unknown option " << arg << "\n";
+			ok = false;
+		}
+		else
+		{
+			options.inputFiles.push_back(arg);
+		}
+
+		if (!ok)
+		{
+			return false;
+		}
+	}
+
+	// a '%' is only allowed as part of a frame pattern.
+	for (const std::string& file : options.inputFiles)
+	{
+		if (file.find('%') != std::string::npos && !IsFrameSequence(file))
+		{
+			std::cout << "Invalid frame pattern " << file << ", use one %d, %Nd or %0Nd and %% for a literal %\n";
+			return false;
+		}
+	}
+	if (options.output.find('%') != std::string::npos && !IsFrameSequence(options.output))
+	{
+		std::cout << "Invalid frame pattern " << options.output << ", use one %d, %Nd or %0Nd and %% for a literal %\n";
+		return false;
+	}
+
+	if (options.inputFiles.empty() || options.width == 0 || options.height == 0 || options.integrator.maxDepth == 0 || options.lastFrame < options.firstFrame)
+	{
+		return false;
+	}
+
+	// a headless render without a stop condition would never finish.
+	if (options.headless && options.spp == 0 && options.timeBudget <= 0.0 && !options.adaptive.enabled)
+	{
+		options.spp = 16;
+	}
+
+	return true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Renderer.h"
+
+// Per pixel adaptive sampling. A pixel stops receiving samples once it has at
+// least minSamples and the standard error of its luminance relative to its mean
+// drops below threshold.
+struct AdaptiveSettings
+{
+	bool enabled = false;
+	float threshold = 0.02f;
+	uint32_t minSamples = 16;
+};
+
+// Order in which the scalar integrator visits the pixels of a tile.
+enum class PixelOrder
+{
+	Scanline,
+	ZOrder
+};
+
+// Screen tile shape, size 0 uses the integrator's default.
+struct TileLayout
+{
+	uint32_t size = 0;
+	PixelOrder order = PixelOrder::Scanline;
+};
+
+struct RenderOptions
+{
+	uint32_t width = 512;
+	uint32_t height = 512;
+
+	// headless batch rendering, no window or OpenGL context is created.
+	bool headless = false;
+
+	// stop conditions for headless rendering, 0 means unlimited.
+	uint32_t spp = 0;
+	double timeBudget = 0.0;
+
+	IntegratorSettings integrator;
+	Camera camera;
+	// reuse camera ray hits across iterations while camera and scene are unchanged.
+	bool hitCache = true;
+	// trace each bounce of a tile as one Embree ray stream.
+	bool wavefront = false;
+	// trace shadow rays one at a time instead of batching them per tile.
+	bool immediateShadows = false;
+	// trace camera rays as RTCRay8/RTCRay16 packets.
+	bool packets = false;
+	// packet width picked at startup from the device capabilities, 0 for single rays.
+	uint32_t packetWidth = 0;
+	AdaptiveSettings adaptive;
+
+	// Tile layout. Whatever is not given on the command line is taken from the
+	// machine's tile profile, or measured against the scene and saved there.
+	TileLayout tiles;
+	bool fixedTileSize = false;
+	bool fixedPixelOrder = false;
+	// measure the tile layout again even if the profile has one.
+	bool calibrate = false;
+	std::string tileProfile = "tiles.profile";
+
+	// load meshes from the binary cache next to each OBJ file, written on first load.
+	bool sceneCache = true;
+	// build each input file as its own scene, committed in parallel and instanced in a top level scene.
+	bool splitScene = false;
+	// bytes the scene and image may take, 0 for no limit. Over it the BVH is built compact, or loading fails.
+	uint64_t memoryBudget = 0;
+	// RTC_SCENE_* flags of the scenes.
+	int sceneFlags = RTC_SCENE_STATIC;
+	// build and trace the scene with several scene flags first and keep the fastest for the sample count.
+	bool benchmarkBuild = false;
+
+	// frames rendered when inputs are per frame OBJ patterns like "walk.%04d.obj".
+	uint32_t firstFrame = 0;
+	uint32_t lastFrame = 0;
+	// per frame instance transforms, moves instanced objects rigidly over the frames.
+	std::string transformTrack;
+
+	std::string output = "color.hdr";
+	std::vector<std::string> inputFiles;
+};
+
+// Scene flags as a comma separated list of names, e.g. "static,compact".
+std::string SceneFlagsName(int sceneFlags);
+bool ParseSceneFlags(const std::string& names, int& sceneFlags);
+
+void PrintUsage(const char* program);
+bool ParseCommandLine(int argc, char* argv[], RenderOptions& options);
@@ -1,17 +1,36 @@
+#include "MemoryTracker.h"
 #include "PPMImage.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <limits>
+#include <vector>
+
+// RGB sum, squared luminance and sample count of every pixel.
+static int64_t imageBytes(uint32_t Width, uint32_t Height)
+{
+	return (int64_t)Width * Height * (4 * sizeof(float) + sizeof(uint32_t));
+}
+
+static float luminance(float r, float g, float b)
+{
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
 
 PPMImage::PPMImage(uint32_t SizeX, uint32_t SizeY)
 	: Width(SizeX), Height(SizeY)
 {
-	if (Width > 0 && Height > 0)
+	// an image over the memory budget holds no pixels and can't be rendered into.
+	if (Width > 0 && Height > 0 && ReserveMemory(MemoryCategory::Images, imageBytes(Width, Height)))
 	{
 		Pixels = new float[Width * Height * 3]();
+		LuminanceSquared = new float[Width * Height]();
+		SampleCounts = new uint32_t[Width * Height]();
 	}
 }
 
@@ -19,9 +38,20 @@ PPMImage::~PPMImage()
 {
 	if (Pixels)
 	{
+		TrackMemory(MemoryCategory::Images, -imageBytes(Width, Height));
 		delete[] Pixels;
 		Pixels = nullptr;
 	}
+	if (LuminanceSquared)
+	{
+		delete[] LuminanceSquared;
+		LuminanceSquared = nullptr;
+	}
+	if (SampleCounts)
+	{
+		delete[] SampleCounts;
+		SampleCounts = nullptr;
+	}
 }
 
 void PPMImage::GetPixel(uint32_t x, uint32_t y, float& r, float& g, float& b)
@@ -44,20 +74,59 @@ void PPMImage::SetPixel(uint32_t x, uint32_t y, float r, float g, float b)
 	}
 }
 
-void PPMImage::Write(const char* Filename, uint32_t iteration) const
+void PPMImage::AddSampleStatistics(uint32_t x, uint32_t y, float r, float g, float b)
+{
+	if (SampleCounts)
+	{
+		const float L = luminance(r, g, b);
+		LuminanceSquared[y * Width + x] += L * L;
+		SampleCounts[y * Width + x]++;
+	}
+}
+
+uint32_t PPMImage::GetSampleCount(uint32_t x, uint32_t y) const
+{
+	return SampleCounts ? SampleCounts[y * Width + x] : 0;
+}
+
+float PPMImage::GetRelativeError(uint32_t x, uint32_t y) const
+{
+	const uint32_t n = GetSampleCount(x, y);
+	if (n < 2)
+	{
+		return std::numeric_limits<float>::infinity();
+	}
+
+	const float* p = &Pixels[(y * Width + x) * 3];
+	const float mean = luminance(p[0], p[1], p[2]) / n;
+	const float variance = std::max(0.0f, (LuminanceSquared[y * Width + x] / n - mean * mean) * n / (n - 1));
+	const float standardError = std::sqrt(variance / n);
+
+	// the small offset keeps black pixels from never converging.
+	return standardError / (mean + 0.001f);
+}
+
+void PPMImage::Resolve(float* Out) const
 {
 	if (Pixels)
 	{
-		for (uint32_t y = 0; y < Height; ++y)
+		for (uint32_t i = 0; i < Width * Height; ++i)
 		{
-			for (uint32_t x = 0; x < Width; ++x)
-			{
-				Pixels[((y * Width + x) * 3) + 0] /= (float)iteration;
-				Pixels[((y * Width + x) * 3) + 1] /= (float)iteration;
-				Pixels[((y * Width + x) * 3) + 2] /= (float)iteration;
-			}
+			const float scale = SampleCounts[i] > 0 ? 1.0f / SampleCounts[i] : 0.0f;
+			Out[i * 3 + 0] = Pixels[i * 3 + 0] * scale;
+			Out[i * 3 + 1] = Pixels[i * 3 + 1] * scale;
+			Out[i * 3 + 2] = Pixels[i * 3 + 2] * scale;
 		}
-		int returnCode = stbi_write_hdr(Filename, Width, Height, 3, Pixels);
+	}
+}
+
+void PPMImage::Write(const char* Filename) const
+{
+	if (Pixels)
+	{
+		std::vector<float> resolved(Width * Height * 3);
+		Resolve(resolved.data());
+		int returnCode = stbi_write_hdr(Filename, Width, Height, 3, resolved.data());
 		assert(returnCode != 0);
 	}
 }
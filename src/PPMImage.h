@@ -1,6 +1,9 @@
 #pragma once
 #include <stdint.h>
 
+// Accumulation buffer. Besides the running RGB sum it keeps, per pixel, the
+// number of samples and the sum of squared sample luminance so the variance
+// of the pixel estimate is known and pixels can be sampled adaptively.
 class PPMImage
 {
 public:
@@ -10,9 +13,20 @@ public:
 
 	void GetPixel(uint32_t x, uint32_t y, float& r, float& g, float& b);
 	void SetPixel(uint32_t x, uint32_t y, float r, float g, float b);
-	void Write(const char * Filename, uint32_t iteration) const;
+
+	// Records that the pixel received one more sample with the given value.
+	void AddSampleStatistics(uint32_t x, uint32_t y, float r, float g, float b);
+	uint32_t GetSampleCount(uint32_t x, uint32_t y) const;
+	// Standard error of the pixel's luminance estimate relative to its mean.
+	float GetRelativeError(uint32_t x, uint32_t y) const;
+
+	// Writes the per pixel mean (sum / sample count) into Out, Width * Height * 3 floats.
+	void Resolve(float* Out) const;
+	void Write(const char * Filename) const;
 
 	float* getPixels() { return Pixels; }
+	// False if the image didn't fit the memory budget.
+	bool isAllocated() const { return Pixels != nullptr; }
 	uint32_t getWidth() const;
 	uint32_t getHeight() const;
 
@@ -20,4 +34,6 @@ private:
 	uint32_t Width = 0;
 	uint32_t Height = 0;
 	float* Pixels = nullptr;
+	float* LuminanceSquared = nullptr;
+	uint32_t* SampleCounts = nullptr;
 };
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <vector>
+
+#include <embree2/rtcore_ray.h>
+
+#include "PacketRenderer.h"
+#include "PPMImage.h"
+#include "PrimaryHitCache.h"
+#include "random_sampler.h"
+
+uint32_t SelectPacketWidth(RTCDevice device)
+{
+	if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT16))
+	{
+		return 16;
+	}
+	if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT8))
+	{
+		return 8;
+	}
+	return 0;
+}
+
+static void intersectPacket(const int* valid, RTCScene scene, const RTCIntersectContext* context, RTCRay8& packet)
+{
+	rtcIntersect8Ex(valid, scene, context, packet);
+}
+
+static void intersectPacket(const int* valid, RTCScene scene, const RTCIntersectContext* context, RTCRay16& packet)
+{
+	rtcIntersect16Ex(valid, scene, context, packet);
+}
+
+template <typename Packet, size_t N>
+static uint64_t renderTilePacketsN(size_t x0, size_t x1, size_t y0, size_t y1, const uint8_t* pixelActive, bool deferShadows, const FrameContext& frame)
+{
+	PPMImage& Color = frame.Color;
+	const uint32_t width = Color.getWidth();
+	const uint32_t height = Color.getHeight();
+	const size_t tileWidth = x1 - x0;
+	const size_t numPixels = tileWidth * (y1 - y0);
+
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_COHERENT;
+	context.userRayExt = nullptr;
+
+	static thread_local ShadowBatch batch;
+	ShadowBatch* shadows = deferShadows ? &batch : nullptr;
+
+	// converged pixels are left out, the remaining ones are packed into full packets.
+	static thread_local std::vector<uint32_t> pixels;
+	pixels.clear();
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		if (pixelActive[i])
+		{
+			pixels.push_back((uint32_t)i);
+		}
+	}
+
+	uint64_t numRays = 0;
+	for (size_t first = 0; first < pixels.size(); first += N)
+	{
+		const size_t numLanes = std::min(N, pixels.size() - first);
+
+		RTCRay rays[N];
+		SurfaceHit hits[N];
+
+		// the packet is only traced if some lane is missing from the hit cache.
+		bool cached = frame.hitCache != nullptr;
+		for (size_t lane = 0; lane < numLanes && cached; ++lane)
+		{
+			const size_t i = pixels[first + lane];
+			cached = frame.hitCache->find((uint32_t)(x0 + i % tileWidth), (uint32_t)(y0 + i / tileWidth), rays[lane], hits[lane]);
+		}
+
+		if (!cached)
+		{
+			Packet packet;
+			alignas(64) int valid[N];
+
+			for (size_t lane = 0; lane < N; ++lane)
+			{
+				const size_t i = lane < numLanes ? pixels[first + lane] : 0;
+				valid[lane] = lane < numLanes ? -1 : 0;
+
+				// inactive lanes still get a well formed ray.
+				const size_t x = x0 + (lane < numLanes ? i % tileWidth : 0);
+				const size_t y = y0 + (lane < numLanes ? i / tileWidth : 0);
+				const RTCRay ray = makeCameraRay(frame.camera, (uint32_t)x, (uint32_t)y, width, height);
+
+				packet.orgx[lane] = ray.org[0];
+				packet.orgy[lane] = ray.org[1];
+				packet.orgz[lane] = ray.org[2];
+				packet.dirx[lane] = ray.dir[0];
+				packet.diry[lane] = ray.dir[1];
+				packet.dirz[lane] = ray.dir[2];
+				packet.tnear[lane] = ray.tnear;
+				packet.tfar[lane] = ray.tfar;
+				packet.time[lane] = ray.time;
+				packet.mask[lane] = ray.mask;
+				packet.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+				packet.primID[lane] = RTC_INVALID_GEOMETRY_ID;
+				packet.instID[lane] = RTC_INVALID_GEOMETRY_ID;
+			}
+
+			intersectPacket(valid, frame.scene, &context, packet);
+			numRays += numLanes;
+
+			for (size_t lane = 0; lane < numLanes; ++lane)
+			{
+				const size_t i = pixels[first + lane];
+				RTCRay& ray = rays[lane];
+				ray = makeRay(vec3(packet.orgx[lane], packet.orgy[lane], packet.orgz[lane]), vec3(packet.dirx[lane], packet.diry[lane], packet.dirz[lane]));
+				ray.tfar = packet.tfar[lane];
+				ray.Ng[0] = packet.Ngx[lane];
+				ray.Ng[1] = packet.Ngy[lane];
+				ray.Ng[2] = packet.Ngz[lane];
+				ray.u = packet.u[lane];
+				ray.v = packet.v[lane];
+				ray.geomID = packet.geomID[lane];
+				ray.primID = packet.primID[lane];
+				ray.instID = packet.instID[lane];
+
+				if (ray.geomID != RTC_INVALID_GEOMETRY_ID)
+				{
+					hits[lane] = getSurfaceHit(frame.scene, frame.Materials, ray);
+				}
+
+				if (frame.hitCache)
+				{
+					frame.hitCache->store((uint32_t)(x0 + i % tileWidth), (uint32_t)(y0 + i / tileWidth), ray, hits[lane]);
+				}
+			}
+		}
+
+		for (size_t lane = 0; lane < numLanes; ++lane)
+		{
+			const size_t i = pixels[first + lane];
+			const uint32_t x = (uint32_t)(x0 + i % tileWidth);
+			const uint32_t y = (uint32_t)(y0 + i / tileWidth);
+
+			embree::RandomSampler sampler;
+			embree::RandomSampler_init(sampler, (int)x, (int)y, (int)frame.iteration);
+
+			uint32_t pathRays = 0;
+			const Radiance Li = tracePath(frame, rays[lane], hits[lane], sampler, pathRays, shadows, y * width + x);
+			numRays += pathRays;
+
+			Radiance Lo(0.0f, 0.0f, 0.0f);
+			Color.GetPixel(x, y, Lo.x, Lo.y, Lo.z);
+			Lo += Li;
+			Color.SetPixel(x, y, Lo.x, Lo.y, Lo.z);
+		}
+	}
+
+	if (shadows)
+	{
+		numRays += resolveShadows(frame.scene, *shadows, Color);
+	}
+
+	return numRays;
+}
+
+uint64_t renderTilePackets(size_t x0, size_t x1, size_t y0, size_t y1, const uint8_t* pixelActive, uint32_t packetWidth, bool deferShadows, const FrameContext& frame)
+{
+	if (packetWidth == 16)
+	{
+		return renderTilePacketsN<RTCRay16, 16>(x0, x1, y0, y1, pixelActive, deferShadows, frame);
+	}
+
+	return renderTilePacketsN<RTCRay8, 8>(x0, x1, y0, y1, pixelActive, deferShadows, frame);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+#include <embree2/rtcore.h>
+
+#include "Renderer.h"
+
+// Picks the widest ray packet the Embree build supports, 16, 8 or 0 when
+// neither rtcIntersect8 nor rtcIntersect16 is available.
+uint32_t SelectPacketWidth(RTCDevice device);
+
+// Traces the camera rays of [x0, x1) x [y0, y1) as coherent packets of
+// packetWidth rays and continues every path with the scalar integrator.
+// Pixels whose entry in pixelActive (row major over the tile) is 0 are skipped.
+// Packets whose camera rays are all in the hit cache are not traced again.
+// The scene needs RTC_INTERSECT8 or RTC_INTERSECT16 to match packetWidth.
+// With deferShadows the tile's shadow rays are resolved as one batch at the end.
+// Returns the number of rays traced.
+uint64_t renderTilePackets(size_t x0, size_t x1, size_t y0, size_t y1, const uint8_t* pixelActive, uint32_t packetWidth, bool deferShadows, const FrameContext& frame);
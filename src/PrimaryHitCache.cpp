@@ -0,0 +1,54 @@
+#include "PrimaryHitCache.h"
+
+void PrimaryHitCache::validate(const Camera& InCamera, uint32_t InWidth, uint32_t InHeight, uint64_t InSceneVersion)
+{
+	if (!entries.empty() && camera == InCamera && width == InWidth && height == InHeight && sceneVersion == InSceneVersion)
+	{
+		return;
+	}
+
+	camera = InCamera;
+	width = InWidth;
+	height = InHeight;
+	sceneVersion = InSceneVersion;
+
+	entries.assign((size_t)width * height, Entry{});
+}
+
+bool PrimaryHitCache::find(uint32_t x, uint32_t y, RTCRay& ray, SurfaceHit& hit) const
+{
+	const Entry& entry = entries[(size_t)y * width + x];
+	if (!entry.valid)
+	{
+		return false;
+	}
+
+	ray = makeCameraRay(camera, x, y, width, height);
+	ray.tfar = entry.tfar;
+	ray.u = entry.u;
+	ray.v = entry.v;
+	ray.geomID = entry.geomID;
+	ray.primID = entry.primID;
+	ray.instID = entry.instID;
+
+	hit.P = vec3(entry.P[0], entry.P[1], entry.P[2]);
+	hit.N = vec3(entry.N[0], entry.N[1], entry.N[2]);
+	hit.brdf = Radiance(entry.brdf[0], entry.brdf[1], entry.brdf[2]);
+	return true;
+}
+
+void PrimaryHitCache::store(uint32_t x, uint32_t y, const RTCRay& ray, const SurfaceHit& hit)
+{
+	Entry& entry = entries[(size_t)y * width + x];
+	entry.tfar = ray.tfar;
+	entry.u = ray.u;
+	entry.v = ray.v;
+	entry.geomID = ray.geomID;
+	entry.primID = ray.primID;
+	entry.instID = ray.instID;
+
+	entry.P[0] = hit.P.x; entry.P[1] = hit.P.y; entry.P[2] = hit.P.z;
+	entry.N[0] = hit.N.x; entry.N[1] = hit.N.y; entry.N[2] = hit.N.z;
+	entry.brdf[0] = hit.brdf.x; entry.brdf[1] = hit.brdf.y; entry.brdf[2] = hit.brdf.z;
+	entry.valid = true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include <embree2/rtcore.h>
+#include <embree2/rtcore_ray.h>
+
+#include "Renderer.h"
+
+// Per pixel cache of camera ray hits. The camera always shoots through the
+// pixel center, so every iteration traces the same primary ray and fetches
+// the same normal. Later iterations start from the stored hit instead.
+//
+// The cache is keyed on the camera, the resolution and a scene version that
+// the caller bumps whenever the scene is recommitted; validate() drops all
+// entries as soon as any of them changes.
+class PrimaryHitCache
+{
+public:
+	void validate(const Camera& camera, uint32_t width, uint32_t height, uint64_t sceneVersion);
+
+	// Rebuilds the intersected camera ray and its surface hit for pixel (x, y).
+	// Returns false if the pixel has not been traced since the last invalidation.
+	bool find(uint32_t x, uint32_t y, RTCRay& ray, SurfaceHit& hit) const;
+	void store(uint32_t x, uint32_t y, const RTCRay& ray, const SurfaceHit& hit);
+
+private:
+	struct Entry
+	{
+		float tfar;
+		float u, v;
+		unsigned geomID, primID, instID;
+		float P[3];
+		float N[3];
+		float brdf[3];
+		bool valid;
+	};
+
+	std::vector<Entry> entries;
+	Camera camera;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint64_t sceneVersion = 0;
+};
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "tbb/tbb.h"
+
+#include "PacketRenderer.h"
+#include "RenderSession.h"
+#include "WavefrontRenderer.h"
+
+/* default size of screen tiles */
+static const size_t TILE_SIZE{ 8 };
+
+/* default size of the tiles traced as one ray stream by the wavefront integrator */
+static const size_t WAVEFRONT_TILE_SIZE{ 32 };
+
+// Interleaves the bits of x and y, neighbouring tiles end up close together.
+static uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+	uint32_t code = 0;
+	for (uint32_t bit = 0; bit < 16; ++bit)
+	{
+		code |= ((x >> bit) & 1u) << (2 * bit);
+		code |= ((y >> bit) & 1u) << (2 * bit + 1);
+	}
+	return code;
+}
+
+static void mortonDecode(uint32_t code, uint32_t& x, uint32_t& y)
+{
+	x = 0;
+	y = 0;
+	for (uint32_t bit = 0; bit < 16; ++bit)
+	{
+		x |= ((code >> (2 * bit)) & 1u) << bit;
+		y |= ((code >> (2 * bit + 1)) & 1u) << bit;
+	}
+}
+
+// Cost buckets a factor of two apart, tiles within a bucket keep their Morton order.
+static int costBucket(float seconds)
+{
+	return seconds > 0.0f ? (int)std::floor(std::log2(seconds)) : std::numeric_limits<int>::min();
+}
+
+RenderSession::RenderSession(const RenderOptions& InOptions)
+	: options(InOptions), color(InOptions.width, InOptions.height)
+{
+	tileSize = options.tiles.size > 0 ? options.tiles.size : (options.wavefront ? WAVEFRONT_TILE_SIZE : TILE_SIZE);
+	numTilesX = (options.width + tileSize - 1) / tileSize;
+	numTilesY = (options.height + tileSize - 1) / tileSize;
+	tileActive.assign(numTilesX * numTilesY, 1);
+	tileCost.assign(numTilesX * numTilesY, 0.0f);
+
+	tileOrder.resize(numTilesX * numTilesY);
+	for (uint32_t i = 0; i < tileOrder.size(); ++i)
+	{
+		tileOrder[i] = i;
+	}
+}
+
+// Drops converged tiles from the queue and puts the most expensive tiles of the
+// last iteration first. Tiles of similar cost are kept in Morton order.
+void RenderSession::scheduleTiles()
+{
+	tileOrder.erase(std::remove_if(tileOrder.begin(), tileOrder.end(), [this](uint32_t tile) { return !tileActive[tile]; }), tileOrder.end());
+
+	const size_t tilesX = numTilesX;
+	std::sort(tileOrder.begin(), tileOrder.end(), [this, tilesX](uint32_t a, uint32_t b)
+	{
+		const int bucketA = costBucket(tileCost[a]);
+		const int bucketB = costBucket(tileCost[b]);
+		if (bucketA != bucketB)
+		{
+			return bucketA > bucketB;
+		}
+		return mortonCode(a % tilesX, a / tilesX) < mortonCode(b % tilesX, b / tilesX);
+	});
+}
+
+bool RenderSession::isPixelConverged(uint32_t x, uint32_t y) const
+{
+	const AdaptiveSettings& adaptive = options.adaptive;
+	return adaptive.enabled && color.GetSampleCount(x, y) >= adaptive.minSamples && color.GetRelativeError(x, y) < adaptive.threshold;
+}
+
+bool RenderSession::isConverged() const
+{
+	return std::find(tileActive.begin(), tileActive.end(), 1) == tileActive.end();
+}
+
+float RenderSession::getMeanRelativeError() const
+{
+	// pixels with fewer than two samples have no error estimate yet and are left out.
+	double sum = 0.0;
+	uint64_t count = 0;
+	for (uint32_t y = 0; y < color.getHeight(); ++y)
+	{
+		for (uint32_t x = 0; x < color.getWidth(); ++x)
+		{
+			const float error = color.GetRelativeError(x, y);
+			if (std::isfinite(error))
+			{
+				sum += error;
+				count++;
+			}
+		}
+	}
+
+	return count > 0 ? (float)(sum / (double)count) : std::numeric_limits<float>::infinity();
+}
+
+uint64_t RenderSession::renderTile(size_t tile, const FrameContext& frame)
+{
+	const uint32_t x0 = (uint32_t)((tile % numTilesX) * tileSize);
+	const uint32_t y0 = (uint32_t)((tile / numTilesX) * tileSize);
+	const uint32_t x1 = std::min(x0 + (uint32_t)tileSize, color.getWidth());
+	const uint32_t y1 = std::min(y0 + (uint32_t)tileSize, color.getHeight());
+	const uint32_t tileWidth = x1 - x0;
+
+	// The integrators add each sample straight into the accumulation buffer,
+	// with direct lighting possibly resolved later in a shadow batch. The
+	// sample value a pixel received this iteration is recovered from the
+	// difference to its sum before the tile was rendered.
+	static thread_local std::vector<float> before;
+	static thread_local std::vector<uint8_t> pixelActive;
+	before.resize(tileWidth * (y1 - y0) * 3);
+	pixelActive.resize(tileWidth * (y1 - y0));
+
+	for (uint32_t y = y0; y < y1; ++y)
+	{
+		for (uint32_t x = x0; x < x1; ++x)
+		{
+			const size_t i = (y - y0) * tileWidth + (x - x0);
+			color.GetPixel(x, y, before[i * 3 + 0], before[i * 3 + 1], before[i * 3 + 2]);
+			pixelActive[i] = !isPixelConverged(x, y);
+		}
+	}
+
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	uint64_t numRays = 0;
+	if (options.wavefront)
+	{
+		numRays += renderTileWavefront(x0, x1, y0, y1, pixelActive.data(), frame);
+	}
+	else if (options.packetWidth > 0)
+	{
+		numRays += renderTilePackets(x0, x1, y0, y1, pixelActive.data(), options.packetWidth, !options.immediateShadows, frame);
+	}
+	else
+	{
+		// shadow rays of the whole tile are traced together once its paths are done.
+		static thread_local ShadowBatch batch;
+		ShadowBatch* shadows = options.immediateShadows ? nullptr : &batch;
+
+		if (options.tiles.order == PixelOrder::ZOrder)
+		{
+			// walk the smallest power of two square covering the tile, neighbouring
+			// pixels are then also close in time.
+			uint32_t side = 1;
+			while (side < tileSize)
+			{
+				side *= 2;
+			}
+
+			for (uint32_t code = 0; code < side * side; ++code)
+			{
+				uint32_t dx, dy;
+				mortonDecode(code, dx, dy);
+				if (x0 + dx < x1 && y0 + dy < y1 && pixelActive[dy * tileWidth + dx])
+				{
+					numRays += renderPixel(x0 + dx, y0 + dy, frame, shadows);
+				}
+			}
+		}
+		else
+		{
+			for (uint32_t y = y0; y < y1; ++y)
+			{
+				for (uint32_t x = x0; x < x1; ++x)
+				{
+					if (pixelActive[(y - y0) * tileWidth + (x - x0)])
+					{
+						numRays += renderPixel(x, y, frame, shadows);
+					}
+				}
+			}
+		}
+
+		if (shadows)
+		{
+			numRays += resolveShadows(frame.scene, *shadows, color);
+		}
+	}
+
+	tileCost[tile] = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+
+	bool converged = true;
+	for (uint32_t y = y0; y < y1; ++y)
+	{
+		for (uint32_t x = x0; x < x1; ++x)
+		{
+			const size_t i = (y - y0) * tileWidth + (x - x0);
+			if (pixelActive[i])
+			{
+				float r, g, b;
+				color.GetPixel(x, y, r, g, b);
+				color.AddSampleStatistics(x, y, r - before[i * 3 + 0], g - before[i * 3 + 1], b - before[i * 3 + 2]);
+			}
+
+			converged = converged && isPixelConverged(x, y);
+		}
+	}
+
+	if (converged)
+	{
+		tileActive[tile] = 0;
+	}
+
+	return numRays;
+}
+
+uint64_t RenderSession::renderIteration(RTCScene scene, uint64_t sceneVersion, const std::vector<Material>& Materials)
+{
+	PrimaryHitCache* cache = options.hitCache ? &hitCache : nullptr;
+	if (cache)
+	{
+		cache->validate(options.camera, color.getWidth(), color.getHeight(), sceneVersion);
+	}
+
+	const FrameContext frame{ scene, Materials, options.integrator, options.camera, cache, color, iteration };
+
+	scheduleTiles();
+
+	// One task per worker thread, each pulling the next tile off the shared
+	// queue until it is empty. Whichever thread is free takes the next tile,
+	// so the expensive tiles at the front start right away and the cheap ones
+	// fill in the gaps at the end of the pass.
+	std::atomic<size_t> nextTile{ 0 };
+	std::atomic<uint64_t> numRays{ 0 };
+	const size_t numWorkers = std::min<size_t>(tileOrder.size(), (size_t)tbb::task_scheduler_init::default_num_threads());
+	tbb::parallel_for(size_t(0), numWorkers, [this, &frame, &nextTile, &numRays](size_t)
+	{
+		uint64_t workerRays = 0;
+		for (size_t i = nextTile++; i < tileOrder.size(); i = nextTile++)
+		{
+			workerRays += renderTile(tileOrder[i], frame);
+		}
+		numRays += workerRays;
+	});
+
+	iteration++;
+	return numRays;
+}
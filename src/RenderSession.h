@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include <embree2/rtcore.h>
+
+#include "Material.h"
+#include "Options.h"
+#include "PPMImage.h"
+#include "PrimaryHitCache.h"
+#include "Renderer.h"
+
+// Owns the accumulation buffer and the rest of the state that lives for one
+// render, and traces iterations over a fixed grid of screen tiles. With
+// adaptive sampling, tiles whose pixels have all converged are skipped.
+//
+// Tiles are handed to the worker threads one at a time from a shared queue.
+// The queue follows the Morton order of the tiles, with tiles that were
+// expensive in the previous iteration moved to the front so that no slow
+// tile is left over when the rest of the pass is done.
+class RenderSession
+{
+public:
+	explicit RenderSession(const RenderOptions& InOptions);
+	RenderSession() = delete;
+
+	// Traces one more sample for every pixel that still needs one.
+	// Returns the number of rays traced.
+	uint64_t renderIteration(RTCScene scene, uint64_t sceneVersion, const std::vector<Material>& Materials);
+
+	// Number of iterations rendered so far.
+	uint32_t getIterations() const { return iteration - 1; }
+	// True once adaptive sampling has no tile left to refine.
+	bool isConverged() const;
+	// Relative error averaged over the pixels with at least two samples,
+	// infinite if there are none.
+	float getMeanRelativeError() const;
+
+	PPMImage& getImage() { return color; }
+	// False if the image didn't fit the memory budget, nothing may be rendered then.
+	bool isAllocated() const { return color.isAllocated(); }
+
+private:
+	void scheduleTiles();
+	uint64_t renderTile(size_t tile, const FrameContext& frame);
+	bool isPixelConverged(uint32_t x, uint32_t y) const;
+
+	const RenderOptions& options;
+	PPMImage color;
+	PrimaryHitCache hitCache;
+
+	size_t tileSize = 8;
+	size_t numTilesX = 0;
+	size_t numTilesY = 0;
+	// tiles that still need samples, only ever cleared by adaptive sampling.
+	std::vector<uint8_t> tileActive;
+	// seconds spent on each tile in the last iteration it was rendered.
+	std::vector<float> tileCost;
+	// active tiles in the order they are handed out.
+	std::vector<uint32_t> tileOrder;
+	uint32_t iteration = 1;
+};
@@ -1,12 +1,15 @@
 #include <algorithm>
 #include <cmath>
+#include <limits>
 
+#include "Instance.h"
 #include "random_sampler.h"
-#include "Random.h"
 #include "Renderer.h"
 #include "PPMImage.h"
+#include "PrimaryHitCache.h"
+#include "Sampling.h"
 
-vec3 WorldGetBackground(const RTCRay& ray)
+Radiance WorldGetBackground(const RTCRay& ray)
 {
 	return vec3{ 0.0f, 0.0f, 0.0f };
 }
@@ -15,9 +18,60 @@ static constexpr float PI = 3.14159265359f;
 static const float Epsilon = 0.001f;
 static const float gamma = 2.2f;
 
-typedef vec3 Radiance;
+static const vec3 LightPosition(0.0f, 1.4f, 0.0f);
+static const vec3 LightPower(1.0f, 1.0f, 1.0f);
 
-static RTCRay makeRay(const vec3& org, const vec3& dir)
+void ShadowBatch::add(const RTCRay& ray, uint32_t pixelIndex, const Radiance& radiance)
+{
+	rays.push_back(ray);
+	pixel.push_back(pixelIndex);
+	contribution.push_back(radiance);
+}
+
+void ShadowBatch::clear()
+{
+	rays.clear();
+	pixel.clear();
+	contribution.clear();
+}
+
+void ShadowBatch::occlude(RTCScene scene, RTCIntersectFlags flags)
+{
+	if (rays.empty())
+	{
+		return;
+	}
+
+	RTCIntersectContext context;
+	context.flags = flags;
+	context.userRayExt = nullptr;
+	rtcOccluded1M(scene, &context, rays.data(), rays.size(), sizeof(RTCRay));
+}
+
+uint64_t resolveShadows(RTCScene scene, ShadowBatch& batch, PPMImage& Color)
+{
+	const uint64_t numRays = batch.size();
+	batch.occlude(scene, RTC_INTERSECT_INCOHERENT);
+
+	const uint32_t width = Color.getWidth();
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		if (batch.visible(i))
+		{
+			const uint32_t x = batch.pixel[i] % width;
+			const uint32_t y = batch.pixel[i] / width;
+			Radiance Lo(0.0f, 0.0f, 0.0f);
+			Color.GetPixel(x, y, Lo.x, Lo.y, Lo.z);
+			Lo += batch.contribution[i];
+			Color.SetPixel(x, y, Lo.x, Lo.y, Lo.z);
+		}
+	}
+
+	batch.clear();
+	return numRays;
+}
+
+RTCRay makeRay(const vec3& org, const vec3& dir)
 {
 	RTCRay ray{};
 	ray.org[0] = org.x;
@@ -32,6 +86,7 @@ static RTCRay makeRay(const vec3& org, const vec3& dir)
 	ray.mask = -1;
 	ray.geomID = RTC_INVALID_GEOMETRY_ID;
 	ray.primID = RTC_INVALID_GEOMETRY_ID;
+	ray.instID = RTC_INVALID_GEOMETRY_ID;
 	return ray;
 }
 
@@ -46,103 +101,159 @@ static bool intersectScene(RTCScene scene, RTCRay& ray)
 	return false;
 }
 
-static Radiance shade(const std::vector<Material>& Materials, const RTCRay& ray)
+static Radiance shade(RTCScene scene, const std::vector<Material>& Materials, const RTCRay& ray)
 {
-	Radiance color(Materials[ray.geomID].DiffuseColor[0], Materials[ray.geomID].DiffuseColor[1], Materials[ray.geomID].DiffuseColor[2]);
+	// every geometry carries the material ID of each of its triangles as user data.
+	const uint32_t* materialIDs = static_cast<const uint32_t*>(rtcGetUserData(scene, ray.geomID));
+	const Material& material = Materials[materialIDs[ray.primID]];
+	Radiance color(material.DiffuseColor[0], material.DiffuseColor[1], material.DiffuseColor[2]);
 	return color / PI;
 }
 
-float visibility(RTCScene scene, const vec3& o, const vec3& d)
-{
-	RTCRay shadowRay = makeRay(o, d);
-	shadowRay.tnear = 0.001f;
-	shadowRay.tfar = 1.0f;
-	rtcOccluded(scene, shadowRay);
-	return shadowRay.geomID ? 1.0f : 0.0f;
-}
-
-static vec3 uniformSampleHemisphere(embree::RandomSampler& sampler)
+SurfaceHit getSurfaceHit(RTCScene scene, const std::vector<Material>& Materials, const RTCRay& ray)
 {
-	const float r1 = RandomSampler_getFloat(sampler);
-	const float r2 = RandomSampler_getFloat(sampler);
-	const float sinTheta = std::sqrtf(1.0f - r1 * r1);
-	const float phi = 2.0f * PI * r2;
-	const float x = sinTheta * std::cosf(phi);
-	const float z = sinTheta * std::sinf(phi);
-	return normalize(vec3(x, r1, z));
-}
+	// intersection location
+	vec3 P(ray.org[0] + ray.dir[0] * ray.tfar, ray.org[1] + ray.dir[1] * ray.tfar, ray.org[2] + ray.dir[2] * ray.tfar);
 
-static void createCoordinateSystem(const vec3& N, vec3& Nt, vec3& Nb)
-{
-	if (std::fabs(N.x) > std::fabs(N.y))
+	// geomID and primID of an instance hit refer to the instanced scene.
+	const Instance* instance = nullptr;
+	if (ray.instID != RTC_INVALID_GEOMETRY_ID)
 	{
-		Nt = vec3(N.z, 0, -N.x) / std::sqrtf(N.x * N.x + N.z * N.z);
+		instance = static_cast<const Instance*>(rtcGetUserData(scene, ray.instID));
+		scene = instance->scene;
 	}
-	else
+
+	vec3 N(0.0f, 0.0f, 0.0f);
+	rtcInterpolate2(scene, ray.geomID, ray.primID, ray.u, ray.v, RTC_USER_VERTEX_BUFFER1, &N.x, nullptr, nullptr, nullptr, nullptr, nullptr, 3);
+	if (instance)
 	{
-		Nt = vec3(0, -N.z, N.y) / std::sqrtf(N.y * N.y + N.z * N.z);
+		N = instance->transformNormal(N);
 	}
+	N = normalize(N);
 
-	Nb = cross(N, Nt);
+	SurfaceHit hit;
+	hit.P = P;
+	hit.N = N;
+	hit.brdf = shade(scene, Materials, ray);
+	return hit;
 }
 
-static vec3 getBRDFRay(const vec3& P, const vec3& N, embree::RandomSampler& sampler)
+bool sampleDirectLighting(const SurfaceHit& hit, RTCRay& shadowRay, Radiance& contribution)
 {
-	const vec3 hemisphereSample = uniformSampleHemisphere(sampler);
-	vec3 Nt(0.0f, 0.0f, 0.0f), Nb(0.0f, 0.0f, 0.0f);
-	createCoordinateSystem(N, Nt, Nb);
-	vec3 sampleWorld(
-		hemisphereSample.x * Nb.x + hemisphereSample.y * N.x + hemisphereSample.z * Nt.x,
-		hemisphereSample.x * Nb.y + hemisphereSample.y * N.y + hemisphereSample.z * Nt.y,
-		hemisphereSample.x * Nb.z + hemisphereSample.y * N.z + hemisphereSample.z * Nt.z);
-	return sampleWorld;
+	const vec3 toLight = LightPosition - hit.P;
+	const vec3 Wi = normalize(toLight);
+
+	// only pay for the shadow ray when the light can contribute.
+	const float cosLight = dot(hit.N, Wi);
+	if (cosLight <= 0.0f)
+	{
+		return false;
+	}
+
+	const float distance = toLight.length();
+	contribution = LightPower / (distance * distance) * cosLight * hit.brdf;
+
+	shadowRay = makeRay(hit.P, toLight);
+	shadowRay.tnear = 0.001f;
+	shadowRay.tfar = 1.0f;
+	return true;
 }
 
-static Radiance pathTraceRayRecursive(RTCScene scene, const std::vector<Material>& Materials, RTCRay& ray, embree::RandomSampler& sampler, uint32_t bounces)
+bool continuePath(const IntegratorSettings& settings, const SurfaceHit& hit, uint32_t depth, embree::RandomSampler& sampler, vec3& throughput, RTCRay& nextRay)
 {
-	if (bounces == 0)
+	if (depth + 1 >= settings.maxDepth)
 	{
-		return Radiance(0.0f, 0.0f, 0.0f);
+		return false;
 	}
 
-	Radiance outgoing = Radiance(0.0f, 0.0f, 0.0f);
-	if (intersectScene(scene, ray))
+	const float u1 = RandomSampler_getFloat(sampler);
+	const float u2 = RandomSampler_getFloat(sampler);
+	const Sampling::DirectionSample bounce = Sampling::sampleDiffuse(settings.sampling, hit.N, u1, u2);
+	if (bounce.pdf <= 0.0f)
 	{
-		// intersection location
-		vec3 P(ray.org[0] + ray.dir[0] * ray.tfar, ray.org[1] + ray.dir[1] * ray.tfar, ray.org[2] + ray.dir[2] * ray.tfar);
-		vec3 Q(0.0f, 1.4f, 0.0f);
-		vec3 toLight = Q - P;
-		vec3 Wi = normalize(toLight);
+		return false;
+	}
 
-		vec3 N(0.0f, 0.0f, 0.0f);
-		rtcInterpolate2(scene, ray.geomID, ray.primID, ray.u, ray.v, RTC_USER_VERTEX_BUFFER1, &N.x, nullptr, nullptr, nullptr, nullptr, nullptr, 3);
-		N = normalize(N);
+	const vec3 worldDirection = bounce.direction;
+	throughput *= hit.brdf * (std::max(0.0f, dot(hit.N, worldDirection)) / bounce.pdf);
 
-		vec3 Power = vec3(1.0f, 1.0f, 1.0f);
-		const float distance = toLight.length();
-		vec3 DirectLighting = Power / (distance * distance) * visibility(scene, P, toLight) * std::max(0.0f, dot(N, Wi));
+	// Russian roulette, paths that carry little energy are terminated early
+	// and the survivors are reweighted so the estimate stays unbiased.
+	if (depth + 1 >= settings.rouletteDepth)
+	{
+		const float survival = std::min(maxComponent(throughput), 0.95f);
+		if (survival <= 0.0f || RandomSampler_getFloat(sampler) >= survival)
+		{
+			return false;
+		}
+		throughput /= survival;
+	}
 
-		constexpr float pdf = 1.0f / (2.0f * PI);
+	nextRay = makeRay(hit.P + worldDirection * Epsilon, worldDirection);
+	return true;
+}
 
-		vec3 worldDirection = getBRDFRay(P, N, sampler);
-		vec3 IndirectLighting = pathTraceRayRecursive(scene, Materials, makeRay(P + worldDirection * Epsilon, worldDirection), sampler, bounces - 1) / pdf * std::max(0.0f, dot(N, normalize(worldDirection)));
+Radiance tracePath(const FrameContext& frame, const RTCRay& primaryRay, const SurfaceHit& primaryHit, embree::RandomSampler& sampler, uint32_t& numRays, ShadowBatch* shadows, uint32_t pixelIndex)
+{
+	RTCScene scene = frame.scene;
+	const IntegratorSettings& settings = frame.settings;
 
-		outgoing += (DirectLighting + IndirectLighting) * shade(Materials, ray);
-	}
-	else
+	Radiance outgoing(0.0f, 0.0f, 0.0f);
+	vec3 throughput(1.0f, 1.0f, 1.0f);
+	RTCRay ray = primaryRay;
+
+	for (uint32_t depth = 0; depth < settings.maxDepth; ++depth)
 	{
-		outgoing += WorldGetBackground(ray);
+		// the primary ray arrives already intersected.
+		if (depth > 0)
+		{
+			numRays++;
+			intersectScene(scene, ray);
+		}
+
+		if (ray.geomID == RTC_INVALID_GEOMETRY_ID)
+		{
+			outgoing += throughput * WorldGetBackground(ray);
+			break;
+		}
+
+		const SurfaceHit hit = depth == 0 ? primaryHit : getSurfaceHit(scene, frame.Materials, ray);
+
+		RTCRay shadowRay;
+		Radiance DirectLighting(0.0f, 0.0f, 0.0f);
+		if (sampleDirectLighting(hit, shadowRay, DirectLighting))
+		{
+			if (shadows)
+			{
+				shadows->add(shadowRay, pixelIndex, throughput * DirectLighting);
+			}
+			else
+			{
+				rtcOccluded(scene, shadowRay);
+				numRays++;
+
+				if (shadowRay.geomID)
+				{
+					outgoing += throughput * DirectLighting;
+				}
+			}
+		}
+
+		if (!continuePath(settings, hit, depth, sampler, throughput, ray))
+		{
+			break;
+		}
 	}
 
 	return outgoing;
 }
 
-static RTCRay makeCameraRay(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+RTCRay makeCameraRay(const Camera& camera, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
 	const float pixelNDCX = ((float)x + 0.5f) / width;
 	const float pixelNDCY = ((float)y + 0.5f) / height;
 
-	constexpr float fovAngle = (34.5159f / 2.0f) * (PI / 180.0f);
+	const float fovAngle = (camera.fov / 2.0f) * (PI / 180.0f);
 	const float fov = tan(fovAngle);
 
 	const float aspectRatio = (float)width / height;
@@ -159,7 +270,7 @@ static RTCRay makeCameraRay(uint32_t x, uint32_t y, uint32_t width, uint32_t hei
 		{ 0.0f, 0.0f, 1.0f, 0.0f },
 		{ 0.0f, 0.0f, 0.0f, 1.0f }
 	};
-	translate(CameraToWorld, vec3{ 0.0f, 0.8f, 4.5f });
+	translate(CameraToWorld, camera.position);
 
 	vec3 rayWorldOrigin{ dot(CameraToWorld[0], origin), dot(CameraToWorld[1], origin), dot(CameraToWorld[2], origin) };
 	vec3 rayPWorld{ dot(CameraToWorld[0], rayP), dot(CameraToWorld[1], rayP), dot(CameraToWorld[2], rayP) };
@@ -173,22 +284,41 @@ static RTCRay makeCameraRay(uint32_t x, uint32_t y, uint32_t width, uint32_t hei
 	return makeRay(rayWorldOrigin, rayWorldDir);
 }
 
-void renderPixel(uint32_t x, uint32_t y, RTCScene scene, RandomSample& sampler, const std::vector<Material>& Materials, PPMImage& Color, uint32_t iteration)
+uint32_t tracePrimaryRay(const FrameContext& frame, uint32_t x, uint32_t y, RTCRay& ray, SurfaceHit& hit)
+{
+	if (frame.hitCache && frame.hitCache->find(x, y, ray, hit))
+	{
+		return 0;
+	}
+
+	ray = makeCameraRay(frame.camera, x, y, frame.Color.getWidth(), frame.Color.getHeight());
+	if (intersectScene(frame.scene, ray))
+	{
+		hit = getSurfaceHit(frame.scene, frame.Materials, ray);
+	}
+
+	if (frame.hitCache)
+	{
+		frame.hitCache->store(x, y, ray, hit);
+	}
+
+	return 1;
+}
+
+uint32_t renderPixel(uint32_t x, uint32_t y, const FrameContext& frame, ShadowBatch* shadows)
 {
 	embree::RandomSampler Sampler;
-	embree::RandomSampler_init(Sampler, (int)x, (int)y, (int)iteration);
+	embree::RandomSampler_init(Sampler, (int)x, (int)y, (int)frame.iteration);
 
-	const uint32_t width = Color.getWidth();
-	const uint32_t height = Color.getHeight();
+	const uint32_t width = frame.Color.getWidth();
 
-	// Can we trace all 4 bounces in a ray packet?
-	// Can we shade all 4 intersection results in ispc?
-	// Will this be faster?
-	static const uint32_t bounces = 4;
+	RTCRay cameraRay;
+	SurfaceHit primaryHit;
+	uint32_t numRays = tracePrimaryRay(frame, x, y, cameraRay, primaryHit);
 
-	RTCRay cameraRay = makeCameraRay(x, y, width, height);
 	Radiance currentColor(0.0f, 0.0f, 0.0f);
-	Color.GetPixel(x, y, currentColor.x, currentColor.y, currentColor.z);
-	Radiance Lo = currentColor + (pathTraceRayRecursive(scene, Materials, cameraRay, Sampler, bounces));
-	Color.SetPixel(x, y, Lo.x, Lo.y, Lo.z);
+	frame.Color.GetPixel(x, y, currentColor.x, currentColor.y, currentColor.z);
+	Radiance Lo = currentColor + tracePath(frame, cameraRay, primaryHit, Sampler, numRays, shadows, y * width + x);
+	frame.Color.SetPixel(x, y, Lo.x, Lo.y, Lo.z);
+	return numRays;
 }
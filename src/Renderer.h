@@ -1,13 +1,114 @@
 #pragma once
 
+#include <stdint.h>
 #include <vector>
 
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 
 #include "Material.h"
+#include "random_sampler.h"
+#include "Sampling.h"
 #include "VectorTypes.h"
 
 class PPMImage;
+class PrimaryHitCache;
 
-void renderPixel(uint32_t x, uint32_t y, RTCScene scene, RandomSample& sampler, const std::vector<Material>& Materials, PPMImage& Color, uint32_t iteration);
+typedef vec3 Radiance;
+
+// Pinhole camera looking down -z.
+struct Camera
+{
+	vec3 position{ 0.0f, 0.8f, 4.5f };
+	// vertical field of view in degrees.
+	float fov = 34.5159f;
+
+	bool operator==(const Camera& rhs) const
+	{
+		return position.x == rhs.position.x && position.y == rhs.position.y && position.z == rhs.position.z && fov == rhs.fov;
+	}
+	bool operator!=(const Camera& rhs) const { return !(*this == rhs); }
+};
+
+struct IntegratorSettings
+{
+	// maximum number of path vertices, including the camera ray hit.
+	uint32_t maxDepth = 8;
+	// depth from which Russian roulette may terminate a path.
+	uint32_t rouletteDepth = 3;
+	// how bounce directions are distributed over the hemisphere.
+	Sampling::Strategy sampling = Sampling::Strategy::Cosine;
+};
+
+// Shading data at a ray hit.
+struct SurfaceHit
+{
+	vec3 P{ 0.0f, 0.0f, 0.0f };
+	vec3 N{ 0.0f, 0.0f, 0.0f };
+	Radiance brdf{ 0.0f, 0.0f, 0.0f };
+};
+
+// Everything the integrators need to render one iteration.
+struct FrameContext
+{
+	RTCScene scene;
+	const std::vector<Material>& Materials;
+	const IntegratorSettings& settings;
+	const Camera& camera;
+	// optional cache of camera ray hits, may be null.
+	PrimaryHitCache* hitCache;
+	PPMImage& Color;
+	uint32_t iteration;
+};
+
+// Shadow rays deferred by the integrators and resolved together with a single
+// rtcOccluded1M call (the scene needs RTC_INTERSECT_STREAM). Each ray carries
+// the radiance it adds to a pixel when the light is visible.
+struct ShadowBatch
+{
+	std::vector<RTCRay> rays;
+	std::vector<uint32_t> pixel;
+	std::vector<Radiance> contribution;
+
+	void add(const RTCRay& ray, uint32_t pixelIndex, const Radiance& radiance);
+	void clear();
+	size_t size() const { return rays.size(); }
+
+	// Traces all rays in the batch, afterwards visible() reports the result per ray.
+	void occlude(RTCScene scene, RTCIntersectFlags flags);
+	bool visible(size_t i) const { return rays[i].geomID != 0; }
+};
+
+// Occludes the batch, adds the visible contributions to Color (pixel is y * width + x)
+// and clears it. Returns the number of shadow rays traced.
+uint64_t resolveShadows(RTCScene scene, ShadowBatch& batch, PPMImage& Color);
+
+RTCRay makeRay(const vec3& org, const vec3& dir);
+RTCRay makeCameraRay(const Camera& camera, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+Radiance WorldGetBackground(const RTCRay& ray);
+
+// Fetches position, shading normal and BRDF for a ray that hit the scene. The
+// material comes from the per triangle material IDs in the geometry's user data.
+SurfaceHit getSurfaceHit(RTCScene scene, const std::vector<Material>& Materials, const RTCRay& ray);
+
+// Builds the shadow ray towards the light and the radiance it carries if unoccluded.
+// Returns false when the light cannot contribute and no shadow ray is needed.
+bool sampleDirectLighting(const SurfaceHit& hit, RTCRay& shadowRay, Radiance& contribution);
+
+// Samples the next path direction, updates the throughput and applies Russian roulette.
+// Returns false when the path terminates.
+bool continuePath(const IntegratorSettings& settings, const SurfaceHit& hit, uint32_t depth, embree::RandomSampler& sampler, vec3& throughput, RTCRay& nextRay);
+
+// Intersects the camera ray of pixel (x, y), or fetches it from the frame's hit cache.
+// hit is only filled in when the ray hit the scene. Returns the number of rays traced.
+uint32_t tracePrimaryRay(const FrameContext& frame, uint32_t x, uint32_t y, RTCRay& ray, SurfaceHit& hit);
+
+// Continues a path from a camera ray that has already been intersected with the scene,
+// primaryHit is the surface hit of that ray when it hit anything.
+// When shadows is not null, direct lighting is deferred into the batch for pixelIndex
+// instead of being traced immediately, and is not part of the returned radiance.
+Radiance tracePath(const FrameContext& frame, const RTCRay& primaryRay, const SurfaceHit& primaryHit, embree::RandomSampler& sampler, uint32_t& numRays, ShadowBatch* shadows = nullptr, uint32_t pixelIndex = 0);
+
+// Accumulates one path traced sample into frame.Color, returns the number of rays traced.
+// Deferred shadow rays are only counted once the batch is resolved.
+uint32_t renderPixel(uint32_t x, uint32_t y, const FrameContext& frame, ShadowBatch* shadows = nullptr);
@@ -0,0 +1,93 @@
+#pragma once
+#include <cmath>
+
+#include "VectorTypes.h"
+
+// Hemisphere sampling routines. Directions are generated in a local frame
+// where +y is the surface normal and are returned together with their pdf
+// (with respect to solid angle) so the integrator can weight them.
+//
+// For a Lambertian BRDF the estimator is brdf * cos / pdf. With uniform
+// sampling that is albedo * 2 * cos, whose variance per bounce is albedo^2 / 3.
+// Cosine-weighted sampling cancels the cosine exactly, so the weight is the
+// constant albedo and the only remaining variance comes from the incoming
+// radiance itself.
+
+namespace Sampling
+{
+	static constexpr float Pi = 3.14159265359f;
+
+	enum class Strategy
+	{
+		Uniform,
+		Cosine,
+	};
+
+	struct DirectionSample
+	{
+		vec3 direction;
+		float pdf;
+	};
+
+	inline vec3 uniformSampleHemisphere(float u1, float u2)
+	{
+		const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - u1 * u1));
+		const float phi = 2.0f * Pi * u2;
+		return vec3(sinTheta * std::cos(phi), u1, sinTheta * std::sin(phi));
+	}
+
+	inline float uniformHemispherePdf()
+	{
+		return 1.0f / (2.0f * Pi);
+	}
+
+	// Malley's method, uniformly sample the unit disk and project up.
+	inline vec3 cosineSampleHemisphere(float u1, float u2)
+	{
+		const float r = std::sqrt(u1);
+		const float phi = 2.0f * Pi * u2;
+		return vec3(r * std::cos(phi), std::sqrt(std::max(0.0f, 1.0f - u1)), r * std::sin(phi));
+	}
+
+	inline float cosineHemispherePdf(float cosTheta)
+	{
+		return std::max(0.0f, cosTheta) / Pi;
+	}
+
+	inline void createCoordinateSystem(const vec3& N, vec3& Nt, vec3& Nb)
+	{
+		if (std::fabs(N.x) > std::fabs(N.y))
+		{
+			Nt = vec3(N.z, 0, -N.x) / std::sqrt(N.x * N.x + N.z * N.z);
+		}
+		else
+		{
+			Nt = vec3(0, -N.z, N.y) / std::sqrt(N.y * N.y + N.z * N.z);
+		}
+
+		Nb = cross(N, Nt);
+	}
+
+	inline vec3 localToWorld(const vec3& local, const vec3& N)
+	{
+		vec3 Nt(0.0f, 0.0f, 0.0f), Nb(0.0f, 0.0f, 0.0f);
+		createCoordinateSystem(N, Nt, Nb);
+		return vec3(
+			local.x * Nb.x + local.y * N.x + local.z * Nt.x,
+			local.x * Nb.y + local.y * N.y + local.z * Nt.y,
+			local.x * Nb.z + local.y * N.z + local.z * Nt.z);
+	}
+
+	// Samples a bounce direction for a diffuse surface with normal N.
+	inline DirectionSample sampleDiffuse(Strategy strategy, const vec3& N, float u1, float u2)
+	{
+		if (strategy == Strategy::Uniform)
+		{
+			const vec3 local = uniformSampleHemisphere(u1, u2);
+			return { localToWorld(local, N), uniformHemispherePdf() };
+		}
+
+		const vec3 local = cosineSampleHemisphere(u1, u2);
+		return { localToWorld(local, N), cosineHemispherePdf(local.y) };
+	}
+}
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "MappedFile.h"
+#include "SceneCache.h"
+
+/* bump whenever the layout below changes */
+static const uint32_t SCENE_CACHE_VERSION{ 3 };
+static const char SCENE_CACHE_MAGIC[8] = { 'E', 'T', 'S', 'C', 'A', 'C', 'H', 'E' };
+static const uint64_t SCENE_CACHE_ALIGNMENT{ 64 };
+
+// Offsets are from the start of the file. Positions are xyzw, normals xyz,
+// texture coordinates uv, indices three per triangle or four per quad and
+// materials DiffuseColor padded to four floats.
+struct SceneCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numMaterials;
+	uint32_t quads;
+	uint32_t padding;
+	// identify the OBJ file the cache was written from.
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint64_t sourceHash;
+
+	uint64_t numVertices;
+	uint64_t numPrimitives;
+	uint64_t materials;
+	uint64_t positions;
+	uint64_t normals;
+	uint64_t texcoords;
+	uint64_t indices;
+	uint64_t materialIDs;
+	uint64_t size;
+};
+
+static std::string cacheFilename(const std::string& ObjFilename)
+{
+	return ObjFilename + ".cache";
+}
+
+static bool getFileInfo(const std::string& Filename, uint64_t& size, int64_t& time)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(Filename.c_str(), &info) != 0)
+	{
+		return false;
+	}
+#else
+	struct stat info;
+	if (stat(Filename.c_str(), &info) != 0)
+	{
+		return false;
+	}
+#endif
+
+	size = (uint64_t)info.st_size;
+	time = (int64_t)info.st_mtime;
+	return true;
+}
+
+// FNV-1a over the whole file, only needed when the timestamp alone can't
+// tell whether the cache is still good.
+static bool hashFile(const std::string& Filename, uint64_t& hash)
+{
+	MappedFile file;
+	if (!file.open(Filename))
+	{
+		return false;
+	}
+
+	hash = 14695981039346656037ull;
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(file.data());
+	for (size_t i = 0; i < file.size(); ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return true;
+}
+
+static uint64_t alignOffset(uint64_t offset)
+{
+	return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+// true if count elements and the padding behind them lie inside the file, so a
+// damaged header can't point the mesh or Embree past the mapping.
+static bool arrayInFile(uint64_t fileSize, uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t padding)
+{
+	if (offset % SCENE_CACHE_ALIGNMENT != 0 || offset > fileSize || padding > fileSize - offset)
+	{
+		return false;
+	}
+	return count <= (fileSize - offset - padding) / elementSize;
+}
+
+Mesh* LoadSceneCache(const std::string& ObjFilename, RTCScene scene, MeshRegistry& registry)
+{
+	uint64_t sourceSize = 0;
+	int64_t sourceTime = 0;
+	if (!getFileInfo(ObjFilename, sourceSize, sourceTime))
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+	if (!file->open(cacheFilename(ObjFilename)) || file->size() < sizeof(SceneCacheHeader))
+	{
+		return nullptr;
+	}
+
+	const char* base = file->data();
+	const SceneCacheHeader& header = *reinterpret_cast<const SceneCacheHeader*>(base);
+	if (std::memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) != 0 || header.version != SCENE_CACHE_VERSION 
+		|| header.size != file->size() || header.sourceSize != sourceSize)
+	{
+		return nullptr;
+	}
+
+	// a new timestamp with the same contents, e.g. after a checkout, keeps the cache.
+	uint64_t sourceHash = 0;
+	if (header.sourceTime != sourceTime && (!hashFile(ObjFilename, sourceHash) || sourceHash != header.sourceHash))
+	{
+		return nullptr;
+	}
+
+	// Embree reads the last element of its buffers with a full SSE load, the
+	// material IDs are only copied.
+	const uint64_t indexSize = header.quads ? sizeof(Quad) : sizeof(Triangle);
+	if (!arrayInFile(file->size(), header.materials, header.numMaterials, 4 * sizeof(float), 0)
+		|| !arrayInFile(file->size(), header.positions, header.numVertices, sizeof(Vertex), 16)
+		|| !arrayInFile(file->size(), header.normals, header.numVertices, sizeof(Normal), 16)
+		|| !arrayInFile(file->size(), header.texcoords, header.numVertices, sizeof(TextureCoord), 16)
+		|| !arrayInFile(file->size(), header.indices, header.numPrimitives, indexSize, 16)
+		|| !arrayInFile(file->size(), header.materialIDs, header.numPrimitives, sizeof(uint32_t), 0))
+	{
+		return nullptr;
+	}
+
+	const int* indices = reinterpret_cast<const int*>(base + header.indices);
+	const uint64_t numIndices = header.numPrimitives * (indexSize / sizeof(int));
+	for (uint64_t i = 0; i < numIndices; ++i)
+	{
+		if (indices[i] < 0 || (uint64_t)indices[i] >= header.numVertices)
+		{
+			return nullptr;
+		}
+	}
+
+	std::vector<Material> materials(header.numMaterials);
+	const float* cachedMaterials = reinterpret_cast<const float*>(base + header.materials);
+	for (uint32_t m = 0; m < header.numMaterials; ++m)
+	{
+		materials[m] = { { cachedMaterials[4 * m + 0], cachedMaterials[4 * m + 1], cachedMaterials[4 * m + 2] } };
+	}
+
+	// without memory for the copy the OBJ file is loaded instead, and fails the same way.
+	AlignedBuffer<uint32_t> materialIDs;
+	try
+	{
+		materialIDs.allocate(header.numPrimitives);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return nullptr;
+	}
+	std::memcpy(materialIDs.data(), base + header.materialIDs, materialIDs.bytes());
+	for (size_t i = 0; i < materialIDs.size(); ++i)
+	{
+		if (materialIDs[i] >= header.numMaterials)
+		{
+			return nullptr;
+		}
+	}
+	MeshRegistry::remapMaterialIDs(registry.addMaterials(materials), materialIDs);
+
+	Mesh* mesh = new Mesh(file,
+		reinterpret_cast<const Vertex*>(base + header.positions),
+		reinterpret_cast<const Normal*>(base + header.normals),
+		reinterpret_cast<const TextureCoord*>(base + header.texcoords),
+		header.quads ? nullptr : reinterpret_cast<const Triangle*>(base + header.indices),
+		header.quads ? reinterpret_cast<const Quad*>(base + header.indices) : nullptr,
+		std::move(materialIDs),
+		header.numVertices);
+	registry.add(scene, mesh);
+	return mesh;
+}
+
+static void writePadding(std::ofstream& out, uint64_t& offset, uint64_t target)
+{
+	static const char zeros[SCENE_CACHE_ALIGNMENT] = {};
+	while (offset < target)
+	{
+		const uint64_t count = std::min<uint64_t>(target - offset, SCENE_CACHE_ALIGNMENT);
+		out.write(zeros, count);
+		offset += count;
+	}
+}
+
+static void writeArray(std::ofstream& out, uint64_t& offset, uint64_t target, const void* data, uint64_t bytes)
+{
+	writePadding(out, offset, target);
+	out.write(static_cast<const char*>(data), bytes);
+	offset += bytes;
+}
+
+bool WriteSceneCache(const std::string& ObjFilename, const MeshData& mesh, const std::vector<Material>& materials)
+{
+	SceneCacheHeader header;
+	std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+	header.version = SCENE_CACHE_VERSION;
+	header.numMaterials = (uint32_t)materials.size();
+	header.quads = mesh.quads.empty() ? 0 : 1;
+	header.padding = 0;
+	if (!getFileInfo(ObjFilename, header.sourceSize, header.sourceTime) || !hashFile(ObjFilename, header.sourceHash))
+	{
+		return false;
+	}
+
+	std::vector<float> cachedMaterials;
+	for (const Material& material : materials)
+	{
+		cachedMaterials.insert(cachedMaterials.end(), material.DiffuseColor, material.DiffuseColor + 3);
+		cachedMaterials.push_back(0.0f);
+	}
+
+	// lay out the arrays behind the header. The 16 bytes after each array let
+	// Embree read the last element with a full SSE load.
+	header.numVertices = mesh.positions.size();
+	header.numPrimitives = mesh.materialIDs.size();
+	header.materials = alignOffset(sizeof(SceneCacheHeader));
+	header.positions = alignOffset(header.materials + cachedMaterials.size() * sizeof(float));
+	header.normals = alignOffset(header.positions + mesh.positions.bytes() + 16);
+	header.texcoords = alignOffset(header.normals + mesh.normals.bytes() + 16);
+	header.indices = alignOffset(header.texcoords + mesh.texcoords.bytes() + 16);
+	const uint64_t indexBytes = header.quads ? mesh.quads.bytes() : mesh.triangles.bytes();
+	header.materialIDs = alignOffset(header.indices + indexBytes + 16);
+	header.size = header.materialIDs + mesh.materialIDs.bytes();
+
+	// written to a temporary file first so a crash never leaves a truncated cache behind.
+	const std::string Filename = cacheFilename(ObjFilename);
+	const std::string TempFilename = Filename + ".tmp";
+	{
+		std::ofstream out(TempFilename, std::ios::binary | std::ios::trunc);
+		uint64_t written = 0;
+		writeArray(out, written, 0, &header, sizeof(header));
+		writeArray(out, written, header.materials, cachedMaterials.data(), cachedMaterials.size() * sizeof(float));
+		writeArray(out, written, header.positions, mesh.positions.data(), mesh.positions.bytes());
+		writeArray(out, written, header.normals, mesh.normals.data(), mesh.normals.bytes());
+		writeArray(out, written, header.texcoords, mesh.texcoords.data(), mesh.texcoords.bytes());
+		writeArray(out, written, header.indices, header.quads ? (const void*)mesh.quads.data() : (const void*)mesh.triangles.data(), indexBytes);
+		writeArray(out, written, header.materialIDs, mesh.materialIDs.data(), mesh.materialIDs.bytes());
+
+		if (!out)
+		{
+			return false;
+		}
+	}
+
+	std::remove(Filename.c_str());
+	return std::rename(TempFilename.c_str(), Filename.c_str()) == 0;
+}
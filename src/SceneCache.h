@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include <embree2/rtcore.h>
+
+#include "Material.h"
+#include "Mesh.h"
+
+// Binary cache of the welded mesh and material table of an OBJ file, stored
+// next to it as "<file>.cache". Every array starts on a 64 byte boundary in
+// the layout Embree expects, so the cache is memory mapped and its pages are
+// handed to Embree with rtcSetBuffer2 without being copied. Only the per
+// triangle material IDs are copied, to translate them to the shared table.
+
+// Adds the cached mesh of the OBJ file to the scene and returns it. Fails with
+// null if there is no cache, it has another version, it is damaged, or the
+// OBJ file changed since it was written.
+Mesh* LoadSceneCache(const std::string& ObjFilename, RTCScene scene, MeshRegistry& registry);
+
+// Writes the cache for the OBJ file, replacing an existing one.
+// Material IDs of the mesh index the file's own materials.
+bool WriteSceneCache(const std::string& ObjFilename, const MeshData& mesh, const std::vector<Material>& materials);
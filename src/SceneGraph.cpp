@@ -0,0 +1,244 @@
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "tbb/tbb.h"
+
+#include "SceneGraph.h"
+
+static const float IDENTITY_TRANSFORM[12] =
+{
+	1.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 1.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 1.0f, 0.0f,
+};
+
+static bool endsWith(const std::string& s, const std::string& suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool IsSceneDescription(const std::string& Filename)
+{
+	return endsWith(Filename, ".scene");
+}
+
+bool MakeTransform(const std::vector<float>& values, float transform[12])
+{
+	std::copy(IDENTITY_TRANSFORM, IDENTITY_TRANSFORM + 12, transform);
+	if (values.size() == 3)
+	{
+		transform[3] = values[0];
+		transform[7] = values[1];
+		transform[11] = values[2];
+		return true;
+	}
+	if (values.size() == 12)
+	{
+		std::copy(values.begin(), values.end(), transform);
+		return true;
+	}
+	return false;
+}
+
+// Makes a path in a description relative to the directory of the description.
+static std::string resolvePath(const std::string& DescriptionFilename, const std::string& path)
+{
+	const bool absolute = (!path.empty() && (path[0] == '/' || path[0] == '\\')) || path.find(':') != std::string::npos;
+	const size_t slash = DescriptionFilename.find_last_of("/\\");
+	if (absolute || slash == std::string::npos)
+	{
+		return path;
+	}
+
+	return DescriptionFilename.substr(0, slash + 1) + path;
+}
+
+// Normals transform with the inverse transpose, which is the cofactor matrix
+// divided by the determinant. Only the sign of the determinant matters as the
+// renderer normalizes the result.
+static void normalTransform(const float transform[12], float normal[9])
+{
+	const vec3 r0(transform[0], transform[1], transform[2]);
+	const vec3 r1(transform[4], transform[5], transform[6]);
+	const vec3 r2(transform[8], transform[9], transform[10]);
+
+	const vec3 c0 = cross(r1, r2);
+	const vec3 c1 = cross(r2, r0);
+	const vec3 c2 = cross(r0, r1);
+	const float sign = dot(r0, c0) < 0.0f ? -1.0f : 1.0f;
+
+	const vec3 rows[3] = { c0 * sign, c1 * sign, c2 * sign };
+	for (int i = 0; i < 3; ++i)
+	{
+		normal[3 * i + 0] = rows[i].x;
+		normal[3 * i + 1] = rows[i].y;
+		normal[3 * i + 2] = rows[i].z;
+	}
+}
+
+SceneGraph::SceneGraph(RTCDevice InDevice, RTCScene InScene, RTCSceneFlags InSceneFlags, RTCAlgorithmFlags InFlags)
+	: device(InDevice), scene(InScene), sceneFlags(InSceneFlags), flags(InFlags)
+{
+}
+
+SceneGraph::~SceneGraph()
+{
+	for (RTCScene assetScene : assetScenes)
+	{
+		rtcDeleteScene(assetScene);
+	}
+}
+
+size_t SceneGraph::assetIndex(const std::string& Filename)
+{
+	for (size_t i = 0; i < assetFiles.size(); ++i)
+	{
+		if (assetFiles[i] == Filename)
+		{
+			return i;
+		}
+	}
+
+	assetFiles.push_back(Filename);
+	return assetFiles.size() - 1;
+}
+
+void SceneGraph::place(size_t asset, const float transform[12])
+{
+	Placement placement;
+	placement.asset = asset;
+	std::copy(transform, transform + 12, placement.transform);
+	placements.push_back(placement);
+}
+
+void SceneGraph::addFile(const std::string& Filename)
+{
+	place(assetIndex(Filename), IDENTITY_TRANSFORM);
+}
+
+bool SceneGraph::loadDescription(const std::string& Filename, std::string& err)
+{
+	std::ifstream file(Filename);
+	if (!file)
+	{
+		err = "Cannot open scene description " + Filename;
+		return false;
+	}
+
+	std::map<std::string, size_t> assets;
+	std::string line;
+	for (uint32_t lineNumber = 1; std::getline(file, line); ++lineNumber)
+	{
+		const std::string location = Filename + ":" + std::to_string(lineNumber) + ": ";
+		std::istringstream fields(line.substr(0, line.find('#')));
+		std::string keyword, name;
+		if (!(fields >> keyword))
+		{
+			continue;
+		}
+
+		if (keyword == "asset")
+		{
+			std::string path;
+			if (!(fields >> name >> path))
+			{
+				err = location + "expected 'asset <name> <file>'";
+				return false;
+			}
+			assets[name] = assetIndex(resolvePath(Filename, path));
+		}
+		else if (keyword == "instance")
+		{
+			std::vector<float> values;
+			float value = 0.0f;
+			fields >> name;
+			while (fields >> value)
+			{
+				values.push_back(value);
+			}
+
+			const auto asset = assets.find(name);
+			if (asset == assets.end())
+			{
+				err = location + "unknown asset '" + name + "'";
+				return false;
+			}
+
+			float transform[12];
+			if (!MakeTransform(values, transform))
+			{
+				err = location + "expected a translation or a 3x4 transform";
+				return false;
+			}
+			place(asset->second, transform);
+		}
+		else
+		{
+			err = location + "unknown keyword '" + keyword + "'";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void SceneGraph::load(MeshRegistry& registry, bool useCache)
+{
+	assetScenes.resize(assetFiles.size());
+	for (RTCScene& assetScene : assetScenes)
+	{
+		assetScene = rtcDeviceNewScene(device, sceneFlags, flags);
+	}
+
+	// one task per file, each of them parses and welds in parallel itself.
+	tbb::parallel_for(size_t(0), assetFiles.size(), [this, &registry, useCache](size_t i)
+	{
+		LoadObjMesh(assetFiles[i], assetScenes[i], registry, useCache);
+	});
+}
+
+bool SceneGraph::commit(BuildProgress* progress)
+{
+	// Embree builds each BVH on the TBB pool too, so small assets leave no
+	// cores idle while a big one is built.
+	std::atomic<bool> failed{ false };
+	tbb::parallel_for(size_t(0), assetScenes.size(), [this, progress, &failed](size_t i)
+	{
+		if (!CommitScene(assetScenes[i], progress))
+		{
+			failed = true;
+		}
+	});
+
+	if (failed)
+	{
+		return false;
+	}
+
+	// the instances only have to be created once.
+	for (size_t p = instances.size(); p < placements.size(); ++p)
+	{
+		const Placement& placement = placements[p];
+		std::unique_ptr<Instance> instance(new Instance);
+		instance->scene = assetScenes[placement.asset];
+		normalTransform(placement.transform, instance->normalTransform);
+
+		const unsigned instID = rtcNewInstance2(scene, instance->scene);
+		rtcSetTransform2(scene, instID, RTC_MATRIX_ROW_MAJOR, placement.transform);
+		rtcSetUserData(scene, instID, instance.get());
+		instances.push_back(std::move(instance));
+		instIDs.push_back(instID);
+	}
+
+	return true;
+}
+
+void SceneGraph::setTransform(size_t instance, const float transform[12])
+{
+	normalTransform(transform, instances[instance]->normalTransform);
+	rtcSetTransform2(scene, instIDs[instance], RTC_MATRIX_ROW_MAJOR, transform);
+	rtcUpdate(scene, instIDs[instance]);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <embree2/rtcore.h>
+
+#include "BuildProgress.h"
+#include "Instance.h"
+#include "Mesh.h"
+
+// Two level scene: every OBJ file is loaded once into its own asset scene,
+// however often it is placed, and each placement is an instance of it in the
+// top level scene.
+//
+// Placements are read from scene description files, text files with one entry
+// per line, '#' starts a comment:
+//   asset <name> <file.obj>        OBJ files are relative to the description
+//   instance <name> <12 floats>    row-major 3x4 transform
+//   instance <name> <x> <y> <z>    translation only
+class SceneGraph
+{
+public:
+	SceneGraph(RTCDevice InDevice, RTCScene InScene, RTCSceneFlags InSceneFlags, RTCAlgorithmFlags InFlags);
+	~SceneGraph();
+	SceneGraph(const SceneGraph&) = delete;
+	SceneGraph& operator=(const SceneGraph&) = delete;
+
+	bool loadDescription(const std::string& Filename, std::string& err);
+	// Places the OBJ file once, untransformed.
+	void addFile(const std::string& Filename);
+
+	// Loads the OBJ files into their asset scenes, in parallel.
+	void load(MeshRegistry& registry, bool useCache);
+	// Commits the asset scenes in parallel and instances them in the top level
+	// scene, which is left for the caller to commit. Returns false if the
+	// builds were cancelled through progress, which may be null, or ran out
+	// of memory budget.
+	bool commit(BuildProgress* progress = nullptr);
+
+	size_t getNumAssets() const { return assetFiles.size(); }
+	size_t getNumInstances() const { return instances.size(); }
+
+	// Moves a committed instance, in placement order. Only a dynamic top level
+	// scene can be changed after its commit, which then just rebuilds the thin
+	// top level over the instances.
+	void setTransform(size_t instance, const float transform[12]);
+
+private:
+	struct Placement
+	{
+		size_t asset;
+		float transform[12];
+	};
+
+	size_t assetIndex(const std::string& Filename);
+	void place(size_t asset, const float transform[12]);
+
+	RTCDevice device;
+	RTCScene scene;
+	RTCSceneFlags sceneFlags;
+	RTCAlgorithmFlags flags;
+
+	// OBJ files, one asset scene each.
+	std::vector<std::string> assetFiles;
+	std::vector<RTCScene> assetScenes;
+	std::vector<Placement> placements;
+	// user data of the instance geometries, and their IDs in the top level scene.
+	std::vector<std::unique_ptr<Instance>> instances;
+	std::vector<unsigned> instIDs;
+};
+
+// Whether an input file is a scene description rather than an OBJ file.
+bool IsSceneDescription(const std::string& Filename);
+
+// Row-major 3x4 transform from 12 values, or from a translation of 3.
+bool MakeTransform(const std::vector<float>& values, float transform[12]);
@@ -5,8 +5,7 @@
 ScopedTimer::ScopedTimer(const std::string& InputMessage)
 	: message(InputMessage)
 {
-	QueryPerformanceFrequency(&frequency);
-	time0 = GetTime();
+	time0 = std::chrono::high_resolution_clock::now();
 }
 
 ScopedTimer::~ScopedTimer()
@@ -16,11 +15,6 @@ ScopedTimer::~ScopedTimer()
 
 double ScopedTimer::elapsed()
 {
-	return (GetTime() - time0) * 1000.0;
-}
-
-double ScopedTimer::GetTime()
-{
-	QueryPerformanceCounter(&counter);
-	return (double)counter.QuadPart * (1.0 / (double)frequency.QuadPart);
+	const std::chrono::duration<double, std::milli> delta = std::chrono::high_resolution_clock::now() - time0;
+	return delta.count();
 }
@@ -1,6 +1,6 @@
 #pragma once
+#include <chrono>
 #include <string>
-#include <windows.h>
 
 class ScopedTimer
 {
@@ -13,10 +13,6 @@ public:
 	double elapsed();
 
 private:
-	double GetTime();
-
-	LARGE_INTEGER counter;
-	LARGE_INTEGER frequency;
-	double time0 = 0.0;
+	std::chrono::high_resolution_clock::time_point time0;
 	const std::string message;
 };
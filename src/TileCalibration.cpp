@@ -0,0 +1,157 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "tbb/tbb.h"
+
+#include "RenderSession.h"
+#include "TileCalibration.h"
+
+/* iterations rendered per candidate before and while timing */
+static const uint32_t CALIBRATION_WARMUP_ITERATIONS{ 1 };
+static const uint32_t CALIBRATION_ITERATIONS{ 2 };
+
+static const char* pixelOrderName(PixelOrder order)
+{
+	return order == PixelOrder::ZOrder ? "zorder" : "scanline";
+}
+
+std::string TileProfileKey(const RenderOptions& options)
+{
+	std::string integrator = "scalar";
+	if (options.wavefront)
+	{
+		integrator = "wavefront";
+	}
+	else if (options.packetWidth > 0)
+	{
+		integrator = "packet" + std::to_string(options.packetWidth);
+	}
+
+	return integrator + "-" + std::to_string(tbb::task_scheduler_init::default_num_threads()) + "threads";
+}
+
+bool LoadTileProfile(const std::string& Filename, const std::string& key, TileLayout& layout)
+{
+	std::ifstream file(Filename);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string lineKey, order;
+		uint32_t size = 0;
+		if (fields >> lineKey >> size >> order && lineKey == key && size > 0)
+		{
+			layout.size = size;
+			layout.order = order == "zorder" ? PixelOrder::ZOrder : PixelOrder::Scanline;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void SaveTileProfile(const std::string& Filename, const std::string& key, const TileLayout& layout)
+{
+	// keep the entries of other configurations.
+	std::vector<std::string> lines;
+	{
+		std::ifstream file(Filename);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			std::istringstream fields(line);
+			std::string lineKey;
+			if (fields >> lineKey && lineKey != key)
+			{
+				lines.push_back(line);
+			}
+		}
+	}
+
+	lines.push_back(key + " " + std::to_string(layout.size) + " " + pixelOrderName(layout.order));
+
+	std::ofstream file(Filename, std::ios::trunc);
+	for (const std::string& line : lines)
+	{
+		file << line << "\n";
+	}
+
+	if (!file)
+	{
+		std::cout << "Failed to write tile profile " << Filename << "\n";
+	}
+}
+
+TileLayout CalibrateTileLayout(const RenderOptions& options, RTCScene scene, uint64_t sceneVersion, const std::vector<Material>& Materials)
+{
+	std::vector<uint32_t> sizes;
+	if (options.fixedTileSize)
+	{
+		sizes.push_back(options.tiles.size);
+	}
+	else if (options.wavefront)
+	{
+		sizes = { 16, 32, 64 };
+	}
+	else
+	{
+		sizes = { 4, 8, 16, 32 };
+	}
+
+	// only the scalar integrator walks pixels one at a time.
+	std::vector<PixelOrder> orders;
+	if (options.fixedPixelOrder || options.wavefront || options.packetWidth > 0)
+	{
+		orders.push_back(options.tiles.order);
+	}
+	else
+	{
+		orders = { PixelOrder::Scanline, PixelOrder::ZOrder };
+	}
+
+	TileLayout best = options.tiles;
+	double bestRaysPerSecond = -1.0;
+
+	for (uint32_t size : sizes)
+	{
+		for (PixelOrder order : orders)
+		{
+			RenderOptions candidate = options;
+			candidate.tiles.size = size;
+			candidate.tiles.order = order;
+			candidate.adaptive.enabled = false;
+
+			RenderSession session(candidate);
+			if (!session.isAllocated())
+			{
+				std::cout << "Tile " << size << "x" << size << " " << pixelOrderName(order) << ": the image doesn't fit the memory budget\n";
+				continue;
+			}
+			for (uint32_t i = 0; i < CALIBRATION_WARMUP_ITERATIONS; ++i)
+			{
+				session.renderIteration(scene, sceneVersion, Materials);
+			}
+
+			uint64_t numRays = 0;
+			const auto start = std::chrono::high_resolution_clock::now();
+			for (uint32_t i = 0; i < CALIBRATION_ITERATIONS; ++i)
+			{
+				numRays += session.renderIteration(scene, sceneVersion, Materials);
+			}
+			const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+			const double raysPerSecond = seconds > 0.0 ? (double)numRays / seconds : 0.0;
+			std::cout << "Tile " << size << "x" << size << " " << pixelOrderName(order) << ": " << raysPerSecond / 1000000.0 << " Mrays/s\n";
+
+			if (raysPerSecond > bestRaysPerSecond)
+			{
+				bestRaysPerSecond = raysPerSecond;
+				best = candidate.tiles;
+			}
+		}
+	}
+
+	return best;
+}
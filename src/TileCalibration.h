@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <embree2/rtcore.h>
+
+#include "Material.h"
+#include "Options.h"
+
+// The machine tile profile is a text file with one line per configuration,
+// "<key> <tile size> <scanline|zorder>". The key names the integrator and
+// the number of worker threads, so one file can be shared by several setups.
+std::string TileProfileKey(const RenderOptions& options);
+bool LoadTileProfile(const std::string& Filename, const std::string& key, TileLayout& layout);
+void SaveTileProfile(const std::string& Filename, const std::string& key, const TileLayout& layout);
+
+// Renders a few iterations of the scene with each candidate tile layout and
+// returns the one with the highest ray throughput. Parts of the layout fixed
+// on the command line are kept.
+TileLayout CalibrateTileLayout(const RenderOptions& options, RTCScene scene, uint64_t sceneVersion, const std::vector<Material>& Materials);
@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
 
 struct vec3
 {
@@ -125,6 +127,11 @@ inline float dot(const float row[4], vec3 v)
 	return (row[0] * v.x + row[1] * v.y + row[2] * v.z + row[3] * 1.0f);
 }
 
+inline float maxComponent(const vec3& v)
+{
+	return std::max(v.x, std::max(v.y, v.z));
+}
+
 inline vec3 pow(const vec3& v, const float exp)
 {
 	return vec3(std::powf(v.x, exp), std::powf(v.y, exp), std::powf(v.z, exp));
@@ -0,0 +1,176 @@
+#include "WavefrontRenderer.h"
+
+#include "PPMImage.h"
+#include "PrimaryHitCache.h"
+#include "random_sampler.h"
+
+namespace
+{
+	// Structure of arrays state for the paths of one tile. Rays are kept as
+	// an array of RTCRay because that is the layout rtcIntersect1M expects.
+	struct PathQueue
+	{
+		std::vector<RTCRay> rays;
+		std::vector<uint32_t> pixel;
+		std::vector<vec3> throughput;
+		std::vector<embree::RandomSampler> sampler;
+
+		void resize(size_t count)
+		{
+			rays.resize(count);
+			pixel.resize(count);
+			throughput.resize(count, vec3(1.0f, 1.0f, 1.0f));
+			sampler.resize(count);
+		}
+	};
+
+	struct WavefrontState
+	{
+		PathQueue paths;
+		ShadowBatch shadows;
+		std::vector<Radiance> radiance;
+		// surface hits of the camera rays when they come from the hit cache.
+		std::vector<SurfaceHit> primaryHits;
+	};
+}
+
+uint64_t renderTileWavefront(size_t x0, size_t x1, size_t y0, size_t y1, const uint8_t* pixelActive, const FrameContext& frame)
+{
+	RTCScene scene = frame.scene;
+	const IntegratorSettings& settings = frame.settings;
+	PPMImage& Color = frame.Color;
+
+	// queues are reused by every tile a thread renders.
+	static thread_local WavefrontState state;
+
+	const uint32_t width = Color.getWidth();
+	const uint32_t height = Color.getHeight();
+	const size_t tileWidth = x1 - x0;
+	const size_t numPixels = tileWidth * (y1 - y0);
+
+	PathQueue& paths = state.paths;
+	ShadowBatch& shadows = state.shadows;
+	std::vector<Radiance>& radiance = state.radiance;
+	std::vector<SurfaceHit>& primaryHits = state.primaryHits;
+
+	paths.resize(numPixels);
+	radiance.assign(numPixels, Radiance(0.0f, 0.0f, 0.0f));
+	primaryHits.resize(numPixels);
+
+	// the primary stream is only traced if some camera ray is not cached yet.
+	bool primaryCached = frame.hitCache != nullptr;
+
+	// converged pixels get no path, so the camera stream only holds active ones.
+	size_t numActive = 0;
+	for (size_t y = y0; y < y1; ++y)
+	{
+		for (size_t x = x0; x < x1; ++x)
+		{
+			const size_t i = (y - y0) * tileWidth + (x - x0);
+			if (!pixelActive[i])
+			{
+				continue;
+			}
+
+			const size_t path = numActive++;
+			if (!primaryCached || !frame.hitCache->find((uint32_t)x, (uint32_t)y, paths.rays[path], primaryHits[path]))
+			{
+				paths.rays[path] = makeCameraRay(frame.camera, (uint32_t)x, (uint32_t)y, width, height);
+				primaryCached = false;
+			}
+			paths.pixel[path] = (uint32_t)i;
+			paths.throughput[path] = vec3(1.0f, 1.0f, 1.0f);
+			embree::RandomSampler_init(paths.sampler[path], (int)x, (int)y, (int)frame.iteration);
+		}
+	}
+
+	RTCIntersectContext context;
+	context.flags = RTC_INTERSECT_COHERENT;
+	context.userRayExt = nullptr;
+
+	uint64_t numRays = 0;
+	for (uint32_t depth = 0; depth < settings.maxDepth && numActive > 0; ++depth)
+	{
+		const bool useCachedHits = depth == 0 && primaryCached;
+		if (!useCachedHits)
+		{
+			// rays that were already cached are simply traced again, this only happens on the first iteration.
+			rtcIntersect1M(scene, &context, paths.rays.data(), numActive, sizeof(RTCRay));
+			numRays += numActive;
+		}
+
+		// shade in bulk, compacting surviving paths to the front of the queue.
+		shadows.clear();
+		size_t numSurvivors = 0;
+		for (size_t i = 0; i < numActive; ++i)
+		{
+			const RTCRay& ray = paths.rays[i];
+			const uint32_t pixel = paths.pixel[i];
+			vec3 throughput = paths.throughput[i];
+
+			if (ray.geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				if (depth == 0 && frame.hitCache && !useCachedHits)
+				{
+					frame.hitCache->store((uint32_t)(x0 + pixel % tileWidth), (uint32_t)(y0 + pixel / tileWidth), ray, primaryHits[i]);
+				}
+
+				radiance[pixel] += throughput * WorldGetBackground(ray);
+				continue;
+			}
+
+			const SurfaceHit hit = useCachedHits ? primaryHits[i] : getSurfaceHit(scene, frame.Materials, ray);
+			if (depth == 0 && frame.hitCache && !useCachedHits)
+			{
+				frame.hitCache->store((uint32_t)(x0 + pixel % tileWidth), (uint32_t)(y0 + pixel / tileWidth), ray, hit);
+			}
+
+			RTCRay shadowRay;
+			Radiance contribution(0.0f, 0.0f, 0.0f);
+			if (sampleDirectLighting(hit, shadowRay, contribution))
+			{
+				shadows.add(shadowRay, pixel, throughput * contribution);
+			}
+
+			embree::RandomSampler sampler = paths.sampler[i];
+			RTCRay nextRay;
+			if (continuePath(settings, hit, depth, sampler, throughput, nextRay))
+			{
+				// numSurvivors <= i, so compaction never overwrites a path that is still unread.
+				paths.rays[numSurvivors] = nextRay;
+				paths.pixel[numSurvivors] = pixel;
+				paths.throughput[numSurvivors] = throughput;
+				paths.sampler[numSurvivors] = sampler;
+				numSurvivors++;
+			}
+		}
+
+		shadows.occlude(scene, context.flags);
+		numRays += shadows.size();
+
+		for (size_t i = 0; i < shadows.size(); ++i)
+		{
+			if (shadows.visible(i))
+			{
+				radiance[shadows.pixel[i]] += shadows.contribution[i];
+			}
+		}
+
+		numActive = numSurvivors;
+		context.flags = RTC_INTERSECT_INCOHERENT;
+	}
+
+	for (size_t y = y0; y < y1; ++y)
+	{
+		for (size_t x = x0; x < x1; ++x)
+		{
+			const Radiance& Li = radiance[(y - y0) * tileWidth + (x - x0)];
+			Radiance Lo(0.0f, 0.0f, 0.0f);
+			Color.GetPixel((uint32_t)x, (uint32_t)y, Lo.x, Lo.y, Lo.z);
+			Lo += Li;
+			Color.SetPixel((uint32_t)x, (uint32_t)y, Lo.x, Lo.y, Lo.z);
+		}
+	}
+
+	return numRays;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+#include <embree2/rtcore.h>
+
+#include "Renderer.h"
+
+// Traces one sample for every pixel in [x0, x1) x [y0, y1) breadth first,
+// skipping pixels whose entry in pixelActive (row major over the tile) is 0.
+// All camera rays of the tile are generated up front, then each bounce is
+// traced as one ray stream, shaded in bulk and the surviving paths are
+// compacted into the next stream. The scene needs RTC_INTERSECT_STREAM.
+// When every camera ray of the tile is in the hit cache the primary stream is skipped.
+// Returns the number of rays traced.
+uint64_t renderTileWavefront(size_t x0, size_t x1, size_t y0, size_t y1, const uint8_t* pixelActive, const FrameContext& frame);
@@ -1,6 +1,18 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
@@ -9,14 +21,23 @@
 #include <GLFW/glfw3.h>
 #include "tbb/tbb.h"
 
+#include "Animation.h"
+#include "BuildBenchmark.h"
+#include "BuildProgress.h"
 #include "FullscreenQuad.h"
 #include "Material.h"
+#include "MemoryTracker.h"
 #include "Mesh.h"
+#include "Options.h"
+#include "PacketRenderer.h"
 #include "PPMImage.h"
 #include "Random.h"
 #include "Renderer.h"
 #include "RenderKernels/RenderKernels.h"
+#include "RenderSession.h"
+#include "SceneGraph.h"
 #include "ScopedTimer.h"
+#include "TileCalibration.h"
 #include "VectorTypes.h"
 
 static void EmbreeErrorHandler(void* userPtr, const RTCError code, const char* str)
@@ -41,27 +62,89 @@ static void EmbreeErrorHandler(void* userPtr, const RTCError code, const char* s
 	}
 }
 
-/* size of screen tiles */
-static const size_t TILE_SIZE_X{ 8 };
-static const size_t TILE_SIZE_Y{ 8 };
-
-int main(int argc, char* argv[])
+static int runHeadless(const RenderOptions& options, RTCScene scene, uint64_t sceneVersion, const std::vector<Material>& Materials)
 {
-	uint32_t width = 512;
-	uint32_t height = 512;
+	RenderSession session(options);
+	if (!session.isAllocated())
+	{
+		std::cerr << "The image doesn't fit the memory budget." << std::endl;
+		return 1;
+	}
 
-	// don't worry about rounding for now.
-	assert(width % TILE_SIZE_X == 0);
-	assert(height % TILE_SIZE_X == 0);
+	uint64_t numRays = 0;
+	double seconds = 0.0;
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (;;)
+		{
+			numRays += session.renderIteration(scene, sceneVersion, Materials);
 
-	const size_t numTilesX = width / TILE_SIZE_X;
-	const size_t numTilesY = height / TILE_SIZE_Y;
+			seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			const uint32_t samples = session.getIterations();
+			if (options.spp > 0 && samples >= options.spp)
+			{
+				break;
+			}
+			if (options.timeBudget > 0.0 && seconds >= options.timeBudget)
+			{
+				break;
+			}
+			if (session.isConverged())
+			{
+				break;
+			}
+		}
+	}
 
-	if (argc == 1)
+	const uint32_t samples = session.getIterations();
+	const double mraysPerSecond = seconds > 0.0 ? (double)numRays / seconds / 1000000.0 : 0.0;
+	std::cout << "Rendered " << samples << " spp at " << options.width << "x" << options.height 
+		<< " in " << seconds << " s (" << mraysPerSecond << " Mrays/s).\n";
+	if (options.adaptive.enabled)
 	{
-		std::cout << "Usage: " << argv[0] << " input1.obj input2.obj input3.obj\n";
-		return 1;
+		std::cout << "Mean relative error " << session.getMeanRelativeError() << (session.isConverged() ? ", converged.\n" : ".\n");
+	}
+
+	session.getImage().Write(options.output.c_str());
+	return 0;
+}
+
+// Hands the newest resolved image from the render thread to the display loop.
+struct DisplaySnapshot
+{
+	std::mutex mutex;
+	std::vector<float> pixels;
+	uint32_t samples = 0;
+	bool updated = false;
+
+	void publish(PPMImage& color, uint32_t numSamples)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		color.Resolve(pixels.data());
+		samples = numSamples;
+		updated = true;
+	}
+
+	bool acquire(std::vector<float>& outPixels, uint32_t& outSamples)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!updated)
+		{
+			return false;
+		}
+		outPixels.swap(pixels);
+		outSamples = samples;
+		updated = false;
+		return true;
 	}
+};
+
+// Opens the window right away and prepares the scene on the render thread,
+// showing the build progress in the title. Closing the window cancels it.
+static int runInteractive(const RenderOptions& options, const std::function<bool(BuildProgress&)>& prepareScene, const RTCScene& scene, const uint64_t& sceneVersion, const std::vector<Material>& Materials)
+{
+	const uint32_t width = options.width;
+	const uint32_t height = options.height;
 
 	if (!glfwInit())
 	{
@@ -91,96 +174,460 @@ int main(int argc, char* argv[])
 	}
 	glfwSwapInterval(1);
 
+#ifdef _WIN32
 	HMODULE dll = LoadLibrary(L"RenderKernels.dll");
 	assert(dll != nullptr);
 
 	typedef void(*CalculateSceneColorFunc)(RTCScene scene, RTCRay* ray, int width, int height, unsigned char* gl_FragCoord);
 	CalculateSceneColorFunc CalculateSceneColor = (CalculateSceneColorFunc)GetProcAddress(dll, "CalculateSceneColor");
+#endif
+
+	GLuint texture[2];
+	glGenTextures(2, texture);
+	glBindTexture(GL_TEXTURE_2D, texture[0]);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, texture[1]);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	// The render thread keeps the TBB pool busy and publishes the resolved
+	// image after every iteration. The main thread owns the GL
+	// context and only uploads whatever snapshot is newest, so vsync never
+	// throttles path tracing.
+	DisplaySnapshot snapshot;
+	snapshot.pixels.resize(width * height * 3);
+
+	std::atomic<bool> stopRendering{ false };
+	std::atomic<uint64_t> numRays{ 0 };
+
+	BuildProgress progress;
+	std::atomic<bool> sceneReady{ false };
+	// set when the scene couldn't be loaded or built, other than by closing the window.
+	std::atomic<bool> buildFailed{ false };
+	// created once the scene is prepared, the tile layout depends on it.
+	std::unique_ptr<RenderSession> session;
+
+	std::thread renderThread([&]()
+	{
+		if (!prepareScene(progress))
+		{
+			buildFailed = !progress.cancelled;
+			return;
+		}
+
+		session.reset(new RenderSession(options));
+		if (!session->isAllocated())
+		{
+			std::cerr << "The image doesn't fit the memory budget." << std::endl;
+			session.reset();
+			buildFailed = true;
+			return;
+		}
+		sceneReady = true;
+		while (!stopRendering && !session->isConverged())
+		{
+			numRays += session->renderIteration(scene, sceneVersion, Materials);
+			snapshot.publish(session->getImage(), session->getIterations());
+		}
+	});
+
+	{
+		std::vector<float> displayPixels(width * height * 3);
+		uint32_t displaySamples = 0;
+		uint32_t b = 0;
+
+		auto statsTime = std::chrono::high_resolution_clock::now();
+		uint64_t statsRays = 0;
+
+		FullScreenQuad quad;
+		while (!glfwWindowShouldClose(window))
+		{
+			if (snapshot.acquire(displayPixels, displaySamples))
+			{
+				glBindTexture(GL_TEXTURE_2D, texture[b]);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, static_cast<void*>(displayPixels.data()));
+				b = (b + 1) % 2;
+			}
+
+			// pixels are already divided by their own sample count.
+			quad.draw(texture[(b + 1) % 2], 1);
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+
+			const auto now = std::chrono::high_resolution_clock::now();
+			const double seconds = std::chrono::duration<double>(now - statsTime).count();
+			if (buildFailed)
+			{
+				// the reason is on the console, the program ends like a failed headless load.
+				glfwSetWindowTitle(window, "EmbreeTracer - failed to prepare the scene");
+				glfwSetWindowShouldClose(window, GLFW_TRUE);
+			}
+			else if (!sceneReady)
+			{
+				std::string title = "EmbreeTracer - loading meshes";
+				const uint32_t numScenes = progress.numScenes;
+				if (numScenes > 0)
+				{
+					const uint32_t building = std::min(progress.numCommitted + 1, numScenes);
+					const uint32_t percent = (uint32_t)(progress.fraction * 100.0f);
+					title = "EmbreeTracer - building BVH " + std::to_string(building) + "/" + std::to_string(numScenes) + ", " + std::to_string(percent) + "%";
+				}
+				glfwSetWindowTitle(window, title.c_str());
+			}
+			else if (seconds >= 1.0)
+			{
+				const uint64_t rays = numRays;
+				const double mraysPerSecond = (double)(rays - statsRays) / seconds / 1000000.0;
+				const std::string title = "EmbreeTracer - " + std::to_string(displaySamples) + " spp, " + std::to_string(mraysPerSecond) + " Mrays/s";
+				glfwSetWindowTitle(window, title.c_str());
+				statsTime = now;
+				statsRays = rays;
+			}
+		}
+	}
+
+	stopRendering = true;
+	progress.cancelled = true;
+	renderThread.join();
+
+	if (session)
+	{
+		session->getImage().Write(options.output.c_str());
+	}
+
+	glDeleteTextures(2, texture);
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	return buildFailed ? 1 : 0;
+}
+
+enum class SceneBuild
+{
+	Built,
+	Failed,
+	// Embree was refused memory, a compact build may still fit.
+	OverBudget
+};
+
+int main(int argc, char* argv[])
+{
+	RenderOptions options;
+	if (!ParseCommandLine(argc, argv, options))
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
 
 	RTCDevice device = rtcNewDevice();
 	EmbreeErrorHandler(nullptr, rtcDeviceGetError(nullptr), nullptr);
 
 	rtcDeviceSetErrorFunction2(device, EmbreeErrorHandler, nullptr);
+	TrackEmbreeMemory(device);
+	SetMemoryBudget(options.memoryBudget);
 
-	RTCScene scene = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERPOLATE);
-
-	std::vector<TriangleMesh*> Meshes;
-	std::vector<Material> Materials;
+	int algorithmFlags = RTC_INTERSECT1 | RTC_INTERPOLATE;
+	if (options.wavefront || !options.immediateShadows)
+	{
+		algorithmFlags |= RTC_INTERSECT_STREAM;
+	}
 
+	if (options.packets && !options.wavefront)
 	{
-		ScopedTimer MeshLoading("Loading Meshes");
-		const int numObjFiles = argc - 1;
-		for (int i = 0; i < numObjFiles; ++i)
+		options.packetWidth = SelectPacketWidth(device);
+		if (options.packetWidth == 16)
 		{
-			LoadObjMesh(argv[i + 1], scene, Meshes, Materials);
+			algorithmFlags |= RTC_INTERSECT16;
+		}
+		else if (options.packetWidth == 8)
+		{
+			algorithmFlags |= RTC_INTERSECT8;
+		}
+		else
+		{
+			std::cout << "Ray packets are not supported by this Embree build, using single rays.\n";
 		}
-		assert(Meshes.size() == Materials.size());
 	}
 
+	RTCScene scene = nullptr;
+
+	std::vector<Mesh*> Meshes;
+	// shared by all meshes, indexed by their per triangle material IDs.
+	std::vector<Material> Materials;
+
+	// with a scene description or a split scene every file is placed as an
+	// instance, so all hits in the top level scene are instance hits.
+	const bool instancing = options.splitScene || std::any_of(options.inputFiles.begin(), options.inputFiles.end(), IsSceneDescription);
+	std::unique_ptr<SceneGraph> graph;
+
+	// per frame OBJ patterns are loaded as deformable geometry of a dynamic scene.
+	const bool animated = std::any_of(options.inputFiles.begin(), options.inputFiles.end(), IsFrameSequence);
+	std::vector<AnimatedMesh> AnimatedMeshes;
+	if (animated && instancing)
 	{
-		ScopedTimer BuildBVH("Building BVH");
-		rtcCommit(scene);
+		std::cerr << "Animated meshes can't be instanced." << std::endl;
+		rtcDeleteDevice(device);
+		return 1;
 	}
 
-	GLuint texture[2];
-	glGenTextures(2, texture);
-	glBindTexture(GL_TEXTURE_2D, texture[0]);
-		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, texture[1]);
-		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	// a transform track moves instances, frames only commit the top level scene.
+	const bool rigid = !options.transformTrack.empty();
+	std::vector<TransformKey> TransformKeys;
+	if (rigid)
+	{
+		std::string err;
+		if (!instancing)
+		{
+			err = "A transform track needs instances, from a scene description or --split-scene.";
+		}
+		if (!err.empty() || !LoadTransformTrack(options.transformTrack, TransformKeys, err))
+		{
+			std::cerr << err << std::endl;
+			rtcDeleteDevice(device);
+			return 1;
+		}
+	}
 
-	PPMImage color(width, height);
+	// bumped on every commit so cached primary hits are dropped when the scene changes.
+	uint64_t sceneVersion = 0;
 
-	uint32_t b = 0;
-	uint32_t iteration = 1;
+	auto releaseScene = [&]()
 	{
-		FullScreenQuad quad;
-		while (!glfwWindowShouldClose(window))
+		for (Mesh* mesh : Meshes)
 		{
-			{
-				ScopedTimer TraceScene("Parallel Trace Scene");
+			delete mesh;
+		}
+		Meshes.clear();
+		AnimatedMeshes.clear();
+		Materials.clear();
+		graph.reset();
+		if (scene)
+		{
+			rtcDeleteScene(scene);
+			scene = nullptr;
+		}
+	};
 
-				tbb::parallel_for(tbb::blocked_range2d<size_t>(0, height, TILE_SIZE_Y, 0, width, TILE_SIZE_X), 
-					[&scene, &Materials, &color, &iteration](const tbb::blocked_range2d<size_t>& r)
+	// Applies the flags every scene of this run needs on top of sceneFlags, so
+	// that benchmarked candidates are built exactly like the final scene.
+	auto buildScene = [&](int sceneFlags, BuildProgress& progress, BuildTimes& times)
+	{
+		// only dynamic scenes refit their deformable geometry.
+		if (animated)
+		{
+			sceneFlags |= RTC_SCENE_DYNAMIC;
+		}
+
+		// instances can only be moved in a dynamic top level scene, the assets stay as they are.
+		const int topLevelFlags = rigid ? sceneFlags | RTC_SCENE_DYNAMIC : sceneFlags;
+		scene = rtcDeviceNewScene(device, (RTCSceneFlags)topLevelFlags, (RTCAlgorithmFlags)algorithmFlags);
+		graph.reset(new SceneGraph(device, scene, (RTCSceneFlags)sceneFlags, (RTCAlgorithmFlags)algorithmFlags));
+
+		{
+			ScopedTimer MeshLoading("Loading Meshes");
+			MeshRegistry registry(Meshes, Materials);
+			if (instancing)
+			{
+				for (const std::string& file : options.inputFiles)
 				{
-					RandomSample sampler(iteration);
+					std::string err;
+					if (!IsSceneDescription(file))
+					{
+						graph->addFile(file);
+					}
+					else if (!graph->loadDescription(file, err))
+					{
+						std::cerr << err << std::endl;
+						return SceneBuild::Failed;
+					}
+				}
+				graph->load(registry, options.sceneCache);
+			}
+			else
+			{
+				std::vector<std::string> staticFiles;
+				for (const std::string& file : options.inputFiles)
+				{
+					if (!IsFrameSequence(file))
+					{
+						staticFiles.push_back(file);
+						continue;
+					}
 
-					for (size_t y = r.rows().begin(); y != r.rows().end(); ++y)
+					Mesh* mesh = LoadObjMesh(FrameFilename(file, options.firstFrame), scene, registry, false, RTC_GEOMETRY_DEFORMABLE);
+					if (!mesh)
 					{
-						for (size_t x = r.cols().begin(); x != r.cols().end(); ++x)
-						{
-							renderPixel((uint32_t)x, (uint32_t)y, scene, sampler, Materials, color, iteration);
-						}
+						return SceneBuild::Failed;
 					}
-				});
+					AnimatedMesh animatedMesh;
+					animatedMesh.pattern = file;
+					animatedMesh.mesh = mesh;
+					AnimatedMeshes.push_back(animatedMesh);
+				}
+				LoadObjMeshes(staticFiles, scene, registry, options.sceneCache);
+			}
+			times.loadMs = MeshLoading.elapsed();
+		}
+		ReportMemory("loading meshes");
 
-				iteration++;
+		// a compact BVH can't help if the meshes alone don't fit.
+		if (IsOverMemoryBudget())
+		{
+			std::cerr << "The meshes don't fit the memory budget." << std::endl;
+			return SceneBuild::Failed;
+		}
+
+		{
+			ScopedTimer BuildBVH("Building BVH");
+			progress.numScenes = instancing ? (uint32_t)graph->getNumAssets() + 1 : 1;
+			progress.numCommitted = 0;
+			if ((instancing && !graph->commit(&progress)) || !CommitScene(scene, &progress))
+			{
+				return WasEmbreeMemoryRefused() && !progress.cancelled ? SceneBuild::OverBudget : SceneBuild::Failed;
 			}
+			times.buildMs = BuildBVH.elapsed();
+			sceneVersion++;
+		}
+		ReportMemory("building BVH");
 
-			glBindTexture(GL_TEXTURE_2D, texture[b]);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, static_cast<void*>(color.getPixels()));
-			b = (b + 1) % 2;
-			quad.draw(texture[b], iteration);
-			glfwSwapBuffers(window);
-			glfwPollEvents();
+		return SceneBuild::Built;
+	};
+
+	// Loads and builds the scene and settles the tile layout. The window runs
+	// it on its render thread so it stays responsive and can cancel the build.
+	auto prepareScene = [&](BuildProgress& progress)
+	{
+		int sceneFlags = options.sceneFlags;
+		if (options.benchmarkBuild)
+		{
+			ScopedTimer Benchmark("Benchmarking scene builds");
+			sceneFlags = BenchmarkSceneFlags(options, [&](int candidateFlags, BuildTimes& times)
+			{
+				releaseScene();
+				ResetMemoryBudget();
+				return buildScene(candidateFlags, progress, times) == SceneBuild::Built ? scene : nullptr;
+			}, Materials);
+			releaseScene();
+			ResetMemoryBudget();
+
+			if (progress.cancelled)
+			{
+				return false;
+			}
 		}
-	}
 
-	color.Write("color.hdr", iteration);
+		BuildTimes times;
+		SceneBuild build = buildScene(sceneFlags, progress, times);
+		if (build == SceneBuild::OverBudget && !(sceneFlags & RTC_SCENE_COMPACT))
+		{
+			// compact BVHs take less memory for some trace performance.
+			std::cout << "The BVH doesn't fit the memory budget, building a compact one.\n";
+			releaseScene();
+			ResetMemoryBudget();
+			build = buildScene(sceneFlags | RTC_SCENE_COMPACT, progress, times);
+		}
 
-	glDeleteTextures(2, texture);
+		if (build != SceneBuild::Built)
+		{
+			if (build == SceneBuild::OverBudget)
+			{
+				std::cerr << "The scene doesn't fit the memory budget." << std::endl;
+			}
+			return false;
+		}
 
-	glfwDestroyWindow(window);
-	glfwTerminate();
+		if (!options.fixedTileSize || !options.fixedPixelOrder)
+		{
+			const std::string key = TileProfileKey(options);
+			TileLayout profiled;
+			if (!options.calibrate && LoadTileProfile(options.tileProfile, key, profiled))
+			{
+				options.tiles.size = options.fixedTileSize ? options.tiles.size : profiled.size;
+				options.tiles.order = options.fixedPixelOrder ? options.tiles.order : profiled.order;
+			}
+			else
+			{
+				{
+					ScopedTimer Calibration("Calibrating tile layout");
+					options.tiles = CalibrateTileLayout(options, scene, sceneVersion, Materials);
+				}
 
-	for (TriangleMesh* Mesh : Meshes)
+				// a layout constrained by the command line is not the machine's best one.
+				if (!options.fixedTileSize && !options.fixedPixelOrder)
+				{
+					SaveTileProfile(options.tileProfile, key, options.tiles);
+				}
+			}
+		}
+
+		return true;
+	};
+
+	int result = 0;
+	if (options.headless)
+	{
+		BuildProgress progress;
+		if (!prepareScene(progress))
+		{
+			result = 1;
+		}
+		else if (!animated && !rigid)
+		{
+			result = runHeadless(options, scene, sceneVersion, Materials);
+		}
+
+		// Later frames update deformable vertices in place and refit their BVH,
+		// moved instances only rebuild the top level over the instances.
+		size_t nextKey = 0;
+		for (uint32_t frame = options.firstFrame; (animated || rigid) && result == 0 && frame <= options.lastFrame; ++frame)
+		{
+			if (frame != options.firstFrame || rigid)
+			{
+				ScopedTimer Update("Updating frame " + std::to_string(frame));
+				bool updated = true;
+				if (animated && frame != options.firstFrame)
+				{
+					updated = UpdateAnimatedMeshes(AnimatedMeshes, frame);
+				}
+				if (rigid)
+				{
+					updated = updated && ApplyTransformKeys(TransformKeys, nextKey, frame, *graph);
+				}
+
+				if (!updated)
+				{
+					result = 1;
+					break;
+				}
+				if (!CommitScene(scene, nullptr))
+				{
+					std::cerr << "The BVH of frame " << frame << " doesn't fit the memory budget." << std::endl;
+					result = 1;
+					break;
+				}
+				sceneVersion++;
+			}
+
+			RenderOptions frameOptions = options;
+			frameOptions.output = FrameOutputFilename(options.output, frame);
+			result = runHeadless(frameOptions, scene, sceneVersion, Materials);
+		}
+	}
+	else
 	{
-		delete Mesh;
+		if (animated || rigid)
+		{
+			std::cout << "Frames are only rendered with --headless, showing the scene as loaded.\n";
+		}
+		result = runInteractive(options, prepareScene, scene, sceneVersion, Materials);
 	}
-	rtcDeleteScene(scene);
+
+	ReportMemory("rendering");
+
+	releaseScene();
 	rtcDeleteDevice(device);
 
-    return 0;
+    return result;
 }
\ No newline at end of file